@@ -0,0 +1,391 @@
+## 実験データの圧縮アーカイブ(マシン間での受け渡し用)
+## 1. ファイル: マジック(8byte)、バージョン、メッシュ形状のハッシュ(int64)の後に、セクションを並べる
+##    セクション: 種類、展開後のバイト数、圧縮後のバイト数(いずれもint64)、zlib(zippy)で圧縮したデータ
+## 2. セクションの種類
+##    - ファイル: mesh.toml、mesh.bin をそのまま(名前の長さ、名前、内容)
+##    - 実験: 実験ID、電流パターンの番号、記録時刻、エレメント数、頂点数(int64) + σRef, J, V の浮動小数点列
+##    - フレームのレイアウト: フレームストアのヘッダと同じ値(int64)
+##    - フレーム: frameChunkSize個までのフレーム、フレーム数(int64) + 計測時刻 + 値
+## 3. 浮動小数点列・整数列は、64bitの整数表現の差分(実験は隣の値との差、フレームは前のフレームの同じ値との差)を取り、
+##    バイト毎に並べ替えて(上位バイトはほぼ0になる)から圧縮する
+## 4. フレームはチャンク毎に独立に圧縮するため、読み込みは1チャンクずつ展開してフレームストアに追記でき、メモリ使用量は一定
+
+import std/[os, tables, sets, sequtils, strutils]
+import arraymancer, results, zippy
+import db_connector/db_sqlite
+import mesh, cache, database, framestore
+
+const
+  archiveMagic = "NEITARC1"
+  archiveVersion = 1
+  frameChunkSize = 256
+    ## 1つのフレームのセクションに入れるフレーム数
+  archivedFileNames = ["mesh.toml", "mesh.bin"]
+  maxSectionSize = 1 shl 30
+    ## 展開後のセクションの上限(アーカイブは他のマシンから受け取るため、ヘッダの値をそのまま信用して確保しない)
+  maxLayoutSize = 1 shl 16
+    ## フレームのレイアウトの電極数・チャネル数・パターン数の上限
+
+type
+  SectionKind = enum
+    skFile = 1
+    skExperiment = 2
+    skFrameLayout = 3
+    skFrames = 4
+
+  ArchiveFormatError = object of CatchableError
+    ## アーカイブが壊れている(読み込みの途中で送出し、import_archiveでResultに変換する)
+
+  ArchiveSummary* = object
+    numExperiments*: int
+    numFrames*: int
+
+proc delta_shuffle(words: openArray[uint64], stride: int): seq[byte] =
+  ## words[i] - words[i - stride] を下位バイトから順にバイト毎に並べる(バイトbのi番目は b*len(words) + i 番目)
+  let n = len(words)
+  result = newSeq[byte](8*n)
+  for i in 0..<n:
+    let d = if i >= stride: words[i] - words[i - stride] else: words[i]
+    for b in 0..<8:
+      result[b*n + i] = byte((d shr (8*b)) and 0xff)
+
+proc unshuffle_delta(data: openArray[byte], stride: int): seq[uint64] =
+  ## delta_shuffleの逆
+  let n = len(data) div 8
+  result = newSeq[uint64](n)
+  for i in 0..<n:
+    var d = 0'u64
+    for b in 0..<8:
+      d = d or (data[b*n + i].uint64 shl (8*b))
+    result[i] = if i >= stride: d + result[i - stride] else: d
+
+proc add_int(payload: var seq[byte], x: int64) =
+  for b in 0..<8:
+    payload.add(byte((cast[uint64](x) shr (8*b)) and 0xff))
+
+proc read_int(payload: openArray[byte], pos: var int): int =
+  ## 範囲外であればArchiveFormatError
+  if pos < 0 or len(payload) - pos < 8:
+    raise newException(ArchiveFormatError, "truncated data")
+  var x = 0'u64
+  for b in 0..<8:
+    x = x or (payload[pos + b].uint64 shl (8*b))
+  pos += 8
+  return cast[int](x)
+
+proc read_count(payload: openArray[byte], pos: var int, itemSize: int, what: string): int =
+  ## 要素数を読み、残りのデータに収まらない(負の値を含む)ならArchiveFormatError
+  ## 後の 8*要素数 などの計算が桁あふれしないよう、確保・添字の計算の前に確かめる
+  result = read_int(payload, pos)
+  if result < 0 or result > (len(payload) - pos) div itemSize:
+    raise newException(ArchiveFormatError, "invalid " & what)
+
+proc write_section(f: File, kind: SectionKind, payload: seq[byte]) =
+  let compressed = compress(payload, dataFormat = dfZlib)
+  var header: seq[byte]
+  header.add_int(kind.int64)
+  header.add_int(len(payload).int64)
+  header.add_int(len(compressed).int64)
+  discard f.writeBuffer(header[0].addr, len(header))
+  if len(compressed) > 0:
+    discard f.writeBuffer(compressed[0].unsafeAddr, len(compressed))
+
+proc read_section(f: File): (int, seq[byte]) =
+  ## 次のセクション(種類, 展開したデータ)を読む、ファイルの終わりであれば種類は0
+  ## 壊れていればArchiveFormatError(サイズはファイルの残りとmaxSectionSizeで確かめてから確保する)
+  var header = newSeq[byte](24)
+  let numRead = f.readBuffer(header[0].addr, len(header))
+  if numRead == 0:
+    return (0, newSeq[byte]())
+  if numRead != len(header):
+    raise newException(ArchiveFormatError, "truncated section header")
+  var pos = 0
+  let
+    kind = read_int(header, pos)
+    rawSize = read_int(header, pos)
+    compressedSize = read_int(header, pos)
+  if kind notin [skFile.int, skExperiment.int, skFrameLayout.int, skFrames.int] or
+     rawSize < 0 or rawSize > maxSectionSize or compressedSize < 0 or compressedSize.int64 > f.getFileSize - f.getFilePos:
+    raise newException(ArchiveFormatError, "invalid section header")
+
+  var compressed = newSeq[byte](compressedSize)
+  if compressedSize > 0 and f.readBuffer(compressed[0].addr, compressedSize) != compressedSize:
+    raise newException(ArchiveFormatError, "truncated section")
+  var payload: seq[byte]
+  try:
+    payload = uncompress(compressed, dataFormat = dfZlib)
+  except ZippyError as e:
+    raise newException(ArchiveFormatError, e.msg)
+  if len(payload) != rawSize:
+    raise newException(ArchiveFormatError, "size of a section differs")
+  return (kind, payload)
+
+proc parse_file(payload: openArray[byte]): (string, string) =
+  ## ファイルのセクション -> (名前, 内容)
+  var pos = 0
+  let nameLen = read_count(payload, pos, 1, "file section")
+  var name = newString(nameLen)
+  if nameLen > 0:
+    copyMem(name[0].addr, payload[pos].unsafeAddr, nameLen)
+  if name notin archivedFileNames:
+    raise newException(ArchiveFormatError, "unexpected file " & name)
+  var content = newString(len(payload) - pos - nameLen)
+  if len(content) > 0:
+    copyMem(content[0].addr, payload[pos + nameLen].unsafeAddr, len(content))
+  return (name, content)
+
+proc parse_experiment(payload: openArray[byte]): (int, ExperimentRecord) =
+  ## 実験のセクション -> (実験ID, 実験のデータ)
+  var pos = 0
+  let
+    id = read_int(payload, pos)
+    patternID = read_int(payload, pos)
+    timestamp = read_int(payload, pos).int64
+    numElements = read_count(payload, pos, 8, "experiment section")
+    numVertices = read_count(payload, pos, 8, "experiment section")
+  if (len(payload) - pos) div 8 - numElements != 2*numVertices or (len(payload) - pos) mod 8 != 0:
+    raise newException(ArchiveFormatError, "invalid experiment section")
+  let values = unshuffle_delta(payload.toOpenArray(pos, len(payload) - 1), 1).mapIt(cast[float](it))
+  return (id, ExperimentRecord(σRef: values[0..<numElements], J: values[numElements..<numElements + numVertices],
+                               V: values[numElements + numVertices..^1], patternID: patternID, timestamp: timestamp))
+
+proc parse_frame_layout(payload: openArray[byte]): FrameLayout =
+  var
+    pos = 0
+    fields: array[5, int]
+  for k in 0..<5:
+    fields[k] = read_int(payload, pos)
+  if fields[4] notin [fvFloat32.int, fvFloat64.int] or pos != len(payload) or
+     fields[1] notin 0..maxLayoutSize or fields[2] notin 0..maxLayoutSize or fields[3] notin 0..maxLayoutSize:
+    raise newException(ArchiveFormatError, "invalid frame layout")
+  return FrameLayout(meshHash: cast[uint64](fields[0]), numElectrodes: fields[1], numChannels: fields[2],
+                     numPatterns: fields[3], valueKind: FrameValueKind(fields[4]))
+
+proc parse_frames(payload: openArray[byte], numValues: int): (seq[uint64], seq[uint64]) =
+  ## フレームのセクション -> (計測時刻, 値の64bit表現(フレーム順))
+  var pos = 0
+  let count = read_count(payload, pos, 8*(1 + numValues), "frame section")
+  if len(payload) - pos != 8*count*(1 + numValues):
+    raise newException(ArchiveFormatError, "invalid frame section")
+  return (unshuffle_delta(payload.toOpenArray(pos, pos + 8*count - 1), 1),
+          unshuffle_delta(payload.toOpenArray(pos + 8*count, len(payload) - 1), numValues))
+
+proc float_words(values: openArray[float]): seq[uint64] =
+  return values.mapIt(cast[uint64](it))
+
+proc export_archive*(path: string, meshName: string, mesh: Mesh, experimentIDs: seq[int], frames: (int, int)): Result[ArchiveSummary, CatchableError] =
+  ## mesh.toml・mesh.bin、指定した実験、フレームストアの frames[0]..<frames[0] + frames[1] 番目のフレームをアーカイブにする
+  let meshDir = "data/" & meshName
+  var
+    h = init_content_hash()
+    summary: ArchiveSummary
+  h.add(mesh)
+
+  # 実験はアーカイブを作り始める前に読み、欠けていればファイルを作らない
+  let db = open(meshDir & "/mesh.db", "", "", "")
+  let records = db.read_experiments(experimentIDs, len(mesh.elements), len(mesh.vertices), $h)
+  db.close()
+  if records.isErr:
+    return records.error.err()
+
+  var store: FrameStore
+  if frames[1] > 0:
+    let opened = open_frame_store(frame_store_path(meshName))
+    if opened.isErr:
+      return opened.error.err()
+    store = opened.value
+    if store.layout.meshHash != h.value:
+      store.close()
+      return CatchableError(msg: frame_store_path(meshName) & " was recorded on a different mesh").err()
+    if frames[0] < 0 or frames[0] + frames[1] > store.num_frames:
+      store.close()
+      return CatchableError(msg: "frames " & $frames[0] & "..<" & $(frames[0] + frames[1]) & " are not committed (" & $store.num_frames & " frames)").err()
+
+  let tmpPath = path & ".tmp"
+  try:
+    createDir(parentDir(path))
+    var f = open(tmpPath, fmWrite)
+    defer: f.close()
+    f.write(archiveMagic)
+    var header: seq[byte]
+    header.add_int(archiveVersion)
+    header.add_int(cast[int64](h.value))
+    discard f.writeBuffer(header[0].addr, len(header))
+
+    # 1. メッシュ
+    for name in archivedFileNames:
+      if not fileExists(meshDir / name):
+        continue
+      let content = readFile(meshDir / name)
+      var payload: seq[byte]
+      payload.add_int(len(name).int64)
+      payload.add(name.toOpenArrayByte(0, len(name) - 1))
+      if len(content) > 0:
+        payload.add(content.toOpenArrayByte(0, len(content) - 1))
+      f.write_section(skFile, payload)
+
+    # 2. 実験
+    for id in experimentIDs.deduplicate:
+      let record = records.value[id]
+      var payload: seq[byte]
+      for x in [id, record.patternID, record.timestamp.int, len(record.σRef), len(record.J)]:
+        payload.add_int(x.int64)
+      payload.add(delta_shuffle(float_words(concat(record.σRef, record.J, record.V)), 1))
+      f.write_section(skExperiment, payload)
+      summary.numExperiments += 1
+
+    # 3. フレーム: チャンク毎にmmapから読み、前のフレームとの差分を取って圧縮する
+    if frames[1] > 0:
+      var payload: seq[byte]
+      for x in [cast[int](store.layout.meshHash), store.layout.numElectrodes, store.layout.numChannels, store.layout.numPatterns, store.layout.valueKind.int]:
+        payload.add_int(x.int64)
+      f.write_section(skFrameLayout, payload)
+
+      let numValues = store.layout.num_values
+      var first = frames[0]
+      while first < frames[0] + frames[1]:
+        let
+          count = min(frameChunkSize, frames[0] + frames[1] - first)
+          values = store.read_frames(first, count).value
+          timestamps = store.frame_timestamps(first, count).value
+        var payload: seq[byte]
+        payload.add_int(count.int64)
+        payload.add(delta_shuffle(timestamps.mapIt(cast[uint64](it)), 1))
+        payload.add(delta_shuffle(float_words(values.toFlatSeq), numValues))
+        f.write_section(skFrames, payload)
+        first += count
+      summary.numFrames = frames[1]
+  except CatchableError as e:
+    if frames[1] > 0:
+      store.close()
+    discard tryRemoveFile(tmpPath)
+    return CatchableError(msg: "failed to write " & path & ": " & e.msg).err()
+
+  if frames[1] > 0:
+    store.close()
+  try:
+    moveFile(tmpPath, path)
+  except CatchableError as e:
+    return CatchableError(msg: "failed to write " & path & ": " & e.msg).err()
+
+  return summary.ok()
+
+proc import_archive*(path: string, meshName: string): Result[ArchiveSummary, CatchableError] =
+  ## export_archiveで作ったアーカイブを data/meshName に展開する
+  ## 1. アーカイブ全体を読んで検証する(フレームも展開して確かめるが保持しない)、既にある実験IDや異なるレイアウトのフレームストアがあればエラー
+  ##    ここまでは何も書き込まないため、壊れたアーカイブを途中まで取り込むことはない
+  ## 2. 実験を1つのトランザクションでmesh.dbに書き込み、mesh.toml・mesh.binは無い場合のみ書き込む
+  ## 3. もう一度フレームのセクションを読み、チャンク毎に展開してフレームストアに追記する
+  if not fileExists(path):
+    return CatchableError(msg: path & " is not found").err()
+
+  let meshDir = "data/" & meshName
+  var
+    f: File
+    summary: ArchiveSummary
+  if not f.open(path, fmRead):
+    return CatchableError(msg: "failed to open " & path).err()
+  defer: f.close()
+
+  var
+    magic = newString(len(archiveMagic))
+    header = newSeq[byte](16)
+    pos = 0
+  if f.readBuffer(magic[0].addr, len(magic)) != len(magic) or magic != archiveMagic or
+     f.readBuffer(header[0].addr, len(header)) != len(header) or read_int(header, pos) != archiveVersion:
+    return CatchableError(msg: path & " is not a valid archive").err()
+  # 実験は記録時のメッシュ形状のハッシュで書き込む(展開先のメッシュと異なれば読み込み時に検出される)
+  let
+    meshHash = $ContentHash(value: cast[uint64](read_int(header, pos)))
+    sectionsStart = f.getFilePos
+
+  # 1. 検証
+  var
+    files: seq[(string, string)]
+    experiments: seq[(int, ExperimentRecord)]
+    experimentIDs: HashSet[int]
+    layout: FrameLayout
+    hasLayout = false
+  try:
+    while true:
+      let (kindValue, payload) = read_section(f)
+      if kindValue == 0:
+        break
+      case SectionKind(kindValue)
+      of skFile:
+        files.add(parse_file(payload))
+      of skExperiment:
+        let experiment = parse_experiment(payload)
+        if experiment[0] in experimentIDs:
+          raise newException(ArchiveFormatError, "experiment " & $experiment[0] & " appears twice")
+        experimentIDs.incl(experiment[0])
+        experiments.add(experiment)
+      of skFrameLayout:
+        if hasLayout:
+          raise newException(ArchiveFormatError, "more than one frame layout")
+        layout = parse_frame_layout(payload)
+        hasLayout = true
+      of skFrames:
+        if not hasLayout:
+          raise newException(ArchiveFormatError, "frames without a layout")
+        summary.numFrames += len(parse_frames(payload, layout.num_values)[0])
+  except ArchiveFormatError as e:
+    return CatchableError(msg: path & " is broken (" & e.msg & ")").err()
+  summary.numExperiments = len(experiments)
+
+  createDir(meshDir)
+  let db = open(meshDir & "/mesh.db", "", "", "")
+  defer: db.close()
+  let existing = db.existing_experiments(toSeq(experimentIDs))
+  if len(existing) > 0:
+    return CatchableError(msg: "experiments " & existing.join(", ") & " already exist in " & meshDir & "/mesh.db").err()
+  if hasLayout and fileExists(frame_store_path(meshName)):
+    let opened = open_frame_store(frame_store_path(meshName))
+    if opened.isErr:
+      return opened.error.err()
+    var current = opened.value
+    let sameLayout = current.layout == layout
+    current.close()
+    if not sameLayout:
+      return CatchableError(msg: frame_store_path(meshName) & " was recorded with a different mesh or pattern layout").err()
+
+  # 2. 実験・メッシュ
+  let written = db.write_experiments(experiments, meshHash)
+  if written.isErr:
+    return written.error.err()
+  try:
+    for (name, content) in files:
+      if not fileExists(meshDir / name):
+        writeFile(meshDir / name, content)
+  except IOError as e:
+    return CatchableError(msg: "failed to write a mesh file: " & e.msg).err()
+
+  # 3. フレーム
+  if not hasLayout:
+    return summary.ok()
+  let opened = open_frame_store(frame_store_path(meshName), layout)
+  if opened.isErr:
+    return opened.error.err()
+  var store = opened.value
+  defer: store.close()
+  let numValues = layout.num_values
+  var values = newSeq[float](numValues)
+  f.setFilePos(sectionsStart)
+  try:
+    while true:
+      let (kindValue, payload) = read_section(f)
+      if kindValue == 0:
+        break
+      if SectionKind(kindValue) != skFrames:
+        continue
+      let (timestamps, words) = parse_frames(payload, numValues)
+      for k in 0..<len(timestamps):
+        for i in 0..<numValues:
+          values[i] = cast[float](words[k*numValues + i])
+        let appended = store.append_frame(cast[int64](timestamps[k]), values)
+        if appended.isErr:
+          return appended.error.err()
+  except ArchiveFormatError as e:
+    return CatchableError(msg: path & " is broken (" & e.msg & ")").err()
+
+  return summary.ok()
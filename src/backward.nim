@@ -1,16 +1,63 @@
 import std/[math, sugar]
-import arraymancer, results
-import mesh, calc
+import arraymancer, arraymancer/laser/openmp, results
+from nimlapack import dpotrf, dpotrs
+import mesh, geometry, calc, forward, sparse_cholesky
 
-proc δσ_over_δV*(jac: Tensor[float], α = 1.0, p = 1.0): Result[Tensor[float], CatchableError] =
+type
+  ReconstructionSpace* = enum
+    ## 再構成行列を求める際に逆行列を取る空間
+    Auto,
+      ## 計測数とエレメント数の小さい方を自動選択
+    ParameterSpace,
+      ## (JᵀJ + α²Q)⁺Jᵀ、エレメント数*エレメント数の行列を扱う
+    DataSpace,
+      ## Q⁻¹Jᵀ(JQ⁻¹Jᵀ + α²I)⁻¹、計測数*計測数の行列を扱う
+
+proc solve_spd_transposed(S: Tensor[float], B: Tensor[float]): Result[Tensor[float], CatchableError] =
+  ## 対称正定値行列Sについて (S⁻¹B)ᵀ をCholesky分解(LAPACKのpotrf/potrs)で求める
+  ## 行優先のBᵀはLAPACK(列優先)から見るとBそのものなので、potrsの結果はそのまま(S⁻¹B)ᵀの行優先の配列になる
+  var
+    L = S.clone()
+    X = B.transpose.clone()
+    n = S.shape[0].cint
+    nrhs = B.shape[1].cint
+    info: cint
+  if n == 0 or nrhs == 0:
+    return X.ok()
+
+  dpotrf("L", n.addr, cast[ptr cdouble](L.get_offset_ptr), n.addr, info.addr)
+  if info != 0:
+    return CatchableError(msg: "matrix is not positive definite (potrf info = " & $info & ")").err()
+  dpotrs("L", n.addr, nrhs.addr, cast[ptr cdouble](L.get_offset_ptr), n.addr, cast[ptr cdouble](X.get_offset_ptr), n.addr, info.addr)
+  if info != 0:
+    return CatchableError(msg: "potrs failed (info = " & $info & ")").err()
+  return X.ok()
+
+proc δσ_over_δV*(jac: Tensor[float], α = 1.0, p = 1.0, space = Auto): Result[Tensor[float], CatchableError] =
   ## https://ieeexplore.ieee.org/document/6971063/
   ## α: Tikhonovの正則化項の係数
   ## p: Newton-Raphson法に基づく正則化行列のスケーリング項
+  ## space: 計測数がエレメント数より十分少ない場合は、Woodburyの恒等式で同じ作用素を計測空間で求める方が速い
   let
-    JtJ = jac.transpose*jac
-    Q = (diagonalize(JtJ).value).map(x => x.pow(p))
+    numMeasurements = jac.shape[0]
+    numElements = jac.shape[1]
   
-  return ((JtJ + α^2*Q).pinv * (jac.transpose)).ok()
+  if space == ParameterSpace or (space == Auto and numMeasurements >= numElements):
+    let
+      JtJ = jac.transpose*jac
+      Q = (diagonalize(JtJ).value).map(x => x.pow(p))
+    
+    return ((JtJ + α^2*Q).pinv * (jac.transpose)).ok()
+
+  # Q = diag(JᵀJ)^p は対角行列なので、その逆行列は列毎のスケーリングになる
+  # 感度が0のエレメント(Qの対角成分が0)はパラメータ空間版の擬似逆行列と同様に0を割り当てる
+  let
+    QInv = (jac *. jac).sum(axis = 0).map(x => (if x > 0.0: 1.0/x.pow(p) else: 0.0))
+    JQInv = jac *. QInv
+    S = JQInv * jac.transpose + α^2*eye[float](numMeasurements, numMeasurements)
+
+  # SとQ⁻¹は対称なので (S⁻¹JQ⁻¹)ᵀ = Q⁻¹JᵀS⁻¹、α > 0 ではSは対称正定値なのでCholesky分解で解く
+  return solve_spd_transposed(S, JQInv)
 
 proc reconstruct_δσ*(mesh: Mesh, coef: Tensor[float]): Result[Tensor[float], CatchableError] =
   var
@@ -22,25 +69,146 @@ proc reconstruct_δσ*(mesh: Mesh, coef: Tensor[float]): Result[Tensor[float], C
 
   return (coef*δV.toTensor).ok()
 
-proc compute_jac_2d_tri*(mesh: Mesh, stiffnessMatrix: Tensor[float], stackedLocalStiffnessMatrix: Tensor[float]): Result[Tensor[float], CatchableError] =
-  if stiffnessMatrix.shape != [len(mesh.vertices), len(mesh.vertices)]:
-    return CatchableError(msg: "stiffnessMatrix's shape must be [len(mesh.vertices), len(mesh.vertices)]").err()
+proc reconstruct_δσ*(geometry: MeshGeometry, frame: Frame, coef: Tensor[float]): Result[Tensor[float], CatchableError] =
+  if len(frame.ΔV) < geometry.numOuterVertices:
+    return CatchableError(msg: "frame.ΔV must have at least numOuterVertices entries").err()
+  return (coef*frame.ΔV[0..<geometry.numOuterVertices].toTensor).ok()
 
-  if stackedLocalStiffnessMatrix.shape != [len(mesh.elements), 3, 3]:
-    return CatchableError(msg: "stackedLocalStiffnessMatrix's shape must be [len(mesh.elements), 3, 3]").err()
+proc electrode_columns_of_inverse*(numVertices: int, numOuterVertices: int, stiffnessFactor: CholeskyFactor): Tensor[float] =
+  ## 剛性行列の逆行列のうち電極(外周頂点)に対応する列のみを 頂点数*外周頂点数 の行列として取得
+  ## K X = E_electrodes を一度の多列solveで解く(SVDによる擬似逆行列は不要)
+  var electrodes = zeros[float]([numVertices, numOuterVertices])
+  for i in 0..<numOuterVertices:
+    electrodes[i, i] = 1.0
+
+  return stiffnessFactor.solve(electrodes)
+
+proc electrode_columns_of_inverse*(mesh: Mesh, stiffnessFactor: CholeskyFactor): Tensor[float] =
+  return electrode_columns_of_inverse(len(mesh.vertices), mesh.numOuterVertices, stiffnessFactor)
+
+proc compute_jac_2d_tri*(geometry: MeshGeometry, frame: Frame, stiffnessFactor: CholeskyFactor, stackedLocalStiffnessMatrix: Tensor[float]): Result[Tensor[float], CatchableError] =
+  ## エレメント毎に J[_, e] = -K^-1[電極, e の3頂点] * K_e * V[e の3頂点] を計算
+  ## 各列はそのエレメントの3頂点と局所剛性行列のみに依存するため、エレメントをOpenMPのスレッドに分割して並列に計算する
+  ## (-d:openmp を付けずにコンパイルした場合は逐次実行)
+  ## ループ内では一時的なTensorを作らず、転置したヤコビアン(エレメント*外周頂点)の連続領域に直接書き込む
+  let
+    numVertices = geometry.num_vertices
+    numElements = geometry.num_elements
+    numOuterVertices = geometry.numOuterVertices
+  if stiffnessFactor.symbolic.n != numVertices:
+    return CatchableError(msg: "stiffnessFactor's size must be the number of vertices").err()
+
+  if stackedLocalStiffnessMatrix.shape != [numElements, 3, 3]:
+    return CatchableError(msg: "stackedLocalStiffnessMatrix's shape must be [numElements, 3, 3]").err()
+
+  if len(frame.V) != numVertices:
+    return CatchableError(msg: "frame.V's length must be the number of vertices").err()
+
+  if numElements == 0:
+    return zeros[float]([numOuterVertices, 0]).ok()
 
-  var
-    Vs: seq[float]
-    jac = zeros[float]([mesh.numOuterVertices, len(mesh.elements)])
   let
-    stiffMatInv = stiffnessMatrix.pinv[0..<mesh.numOuterVertices, _]
-  for vertice in mesh.vertices.items:
-    Vs.add(vertice.V)
+    stiffMatInv = electrode_columns_of_inverse(numVertices, numOuterVertices, stiffnessFactor)
+    localStiffnessMat = stackedLocalStiffnessMatrix.clone()
+  var jacT = zeros[float]([numElements, numOuterVertices])
 
-  for (i, element) in mesh.elements.pairs:
+  let
+    pInv = cast[ptr UncheckedArray[float]](stiffMatInv.get_offset_ptr)
+    pLocal = cast[ptr UncheckedArray[float]](localStiffnessMat.get_offset_ptr)
+    pJacT = cast[ptr UncheckedArray[float]](jacT.get_offset_ptr)
+    pVs = cast[ptr UncheckedArray[float]](frame.V[0].unsafeAddr)
+    pTri = cast[ptr UncheckedArray[int32]](geometry.tri[0].unsafeAddr)
+
+  omp_parallel_for(e, numElements, omp_grain_size = 16, use_simd = false):
     let
-      slicedStiffMatInv = concat(stiffMatInv[_, element.idxVertice1], stiffMatInv[_, element.idxVertice2], stiffMatInv[_, element.idxVertice3], axis=1)
-      localStiffnessMat = concat(stackedLocalStiffnessMatrix[i, 0, _], stackedLocalStiffnessMatrix[i, 1, _], stackedLocalStiffnessMatrix[i, 2, _], axis=1).reshape(3, 3)
-    jac[_, i] = (-slicedStiffMatInv * localStiffnessMat * @[Vs[element.idxVertice1], Vs[element.idxVertice2], Vs[element.idxVertice3]].toTensor)
+      v1 = pTri[3*e].int
+      v2 = pTri[3*e + 1].int
+      v3 = pTri[3*e + 2].int
+      # K_e * V_e
+      kv1 = pLocal[9*e]*pVs[v1] + pLocal[9*e + 1]*pVs[v2] + pLocal[9*e + 2]*pVs[v3]
+      kv2 = pLocal[9*e + 3]*pVs[v1] + pLocal[9*e + 4]*pVs[v2] + pLocal[9*e + 5]*pVs[v3]
+      kv3 = pLocal[9*e + 6]*pVs[v1] + pLocal[9*e + 7]*pVs[v2] + pLocal[9*e + 8]*pVs[v3]
+    for r in 0..<numOuterVertices:
+      pJacT[e*numOuterVertices + r] = -(pInv[v1*numOuterVertices + r]*kv1 + pInv[v2*numOuterVertices + r]*kv2 + pInv[v3*numOuterVertices + r]*kv3)
   
-  return jac.ok()
\ No newline at end of file
+  return jacT.transpose.clone().ok()
+
+proc compute_jac_2d_tri*(mesh: Mesh, stiffnessFactor: CholeskyFactor, stackedLocalStiffnessMatrix: Tensor[float]): Result[Tensor[float], CatchableError] =
+  return compute_jac_2d_tri(geometry_of(mesh), frame_of(mesh), stiffnessFactor, stackedLocalStiffnessMatrix)
+
+proc adjacent_measurement_patterns*(mesh: Mesh): Tensor[float] =
+  ## 隣接電極間の差電圧を測る計測パターンを 頂点数*電極数 の行列として生成
+  ## 第k列: 電位ベクトルとの内積で V[k] - V[k+1] を取り出す
+  let numElectrodes = mesh.numOuterVertices
+  result = zeros[float]([len(mesh.vertices), numElectrodes])
+  for k in 0..<numElectrodes:
+    result[k, k] = 1.0
+    result[(k+1) mod numElectrodes, k] = -1.0
+
+proc compute_jac_adjoint_2d_tri*(geometry: MeshGeometry, stiffnessFactor: CholeskyFactor, stackedLocalStiffnessMatrix: Tensor[float], driveJs: Tensor[float], measPatterns: Tensor[float]): Result[Tensor[float], CatchableError] =
+  ## 随伴場(相反定理)に基づく複数パターン対応のヤコビアン
+  ## driveJs: 頂点数*注入パターン数、measPatterns: 頂点数*計測パターン数
+  ## 出力: (注入パターン数*計測パターン数)*エレメント数、第(d*計測パターン数 + m)行が注入d・計測mに対応
+  ## 1. 注入パターンの電位 u_d = K^-1 J_d と計測パターンの随伴場 w_m = K^-1 m を一度の多列solveで求める(計 注入数+計測数 回分)
+  ## 2. エレメントeの感度は ∂(m^T u_d)/∂σ_e = -w_m[e]^T K_e u_d[e] (K_eは3*3の局所剛性行列)
+  ## 3. 電位基準点はディリクレ条件で固定されているため、その成分は感度に寄与しない
+  ## compute_jac_2d_tri と同様にエレメントをOpenMPのスレッドに分割し、転置したヤコビアンの連続領域に直接書き込む
+  let
+    numVertices = geometry.num_vertices
+    numElements = geometry.num_elements
+  if stiffnessFactor.symbolic.n != numVertices:
+    return CatchableError(msg: "stiffnessFactor's size must be the number of vertices").err()
+  if stackedLocalStiffnessMatrix.shape != [numElements, 3, 3]:
+    return CatchableError(msg: "stackedLocalStiffnessMatrix's shape must be [numElements, 3, 3]").err()
+  if driveJs.rank != 2 or driveJs.shape[0] != numVertices:
+    return CatchableError(msg: "driveJs's shape must be [numVertices, numDrivePatterns]").err()
+  if measPatterns.rank != 2 or measPatterns.shape[0] != numVertices:
+    return CatchableError(msg: "measPatterns's shape must be [numVertices, numMeasPatterns]").err()
+
+  let
+    numDrive = driveJs.shape[1]
+    numMeas = measPatterns.shape[1]
+    numFields = numDrive + numMeas
+    numRows = numDrive*numMeas
+  if numElements == 0 or numRows == 0:
+    return zeros[float]([numRows, numElements]).ok()
+
+  let
+    idxReferenceVertice = geometry.idx_reference_vertice
+    # solveの戻り値は新しく確保された連続領域(頂点数*(注入数+計測数))
+    fields = stiffnessFactor.solve(concat(driveJs, measPatterns, axis = 1))
+    localStiffnessMat = if stackedLocalStiffnessMatrix.is_C_contiguous: stackedLocalStiffnessMatrix else: stackedLocalStiffnessMatrix.clone()
+  var jacT = zeros[float]([numElements, numRows])
+
+  let
+    pFields = cast[ptr UncheckedArray[float]](fields.get_offset_ptr)
+    pLocal = cast[ptr UncheckedArray[float]](localStiffnessMat.get_offset_ptr)
+    pJacT = cast[ptr UncheckedArray[float]](jacT.get_offset_ptr)
+    pTri = cast[ptr UncheckedArray[int32]](geometry.tri[0].unsafeAddr)
+
+  omp_parallel_for(e, numElements, omp_grain_size = 16, use_simd = false):
+    # 電位基準点の成分は0として扱う
+    let
+      v1 = pTri[3*e].int
+      v2 = pTri[3*e + 1].int
+      v3 = pTri[3*e + 2].int
+      w1 = if v1 == idxReferenceVertice: 0.0 else: 1.0
+      w2 = if v2 == idxReferenceVertice: 0.0 else: 1.0
+      w3 = if v3 == idxReferenceVertice: 0.0 else: 1.0
+    for d in 0..<numDrive:
+      # K_e u_d[e]
+      let
+        u1 = w1*pFields[v1*numFields + d]
+        u2 = w2*pFields[v2*numFields + d]
+        u3 = w3*pFields[v3*numFields + d]
+        ku1 = w1*(pLocal[9*e]*u1 + pLocal[9*e + 1]*u2 + pLocal[9*e + 2]*u3)
+        ku2 = w2*(pLocal[9*e + 3]*u1 + pLocal[9*e + 4]*u2 + pLocal[9*e + 5]*u3)
+        ku3 = w3*(pLocal[9*e + 6]*u1 + pLocal[9*e + 7]*u2 + pLocal[9*e + 8]*u3)
+      # -w_m[e]^T (K_e u_d[e])
+      for m in 0..<numMeas:
+        pJacT[e*numRows + d*numMeas + m] = -(pFields[v1*numFields + numDrive + m]*ku1 + pFields[v2*numFields + numDrive + m]*ku2 + pFields[v3*numFields + numDrive + m]*ku3)
+
+  return jacT.transpose.clone().ok()
+
+proc compute_jac_adjoint_2d_tri*(mesh: Mesh, stiffnessFactor: CholeskyFactor, stackedLocalStiffnessMatrix: Tensor[float], driveJs: Tensor[float], measPatterns: Tensor[float]): Result[Tensor[float], CatchableError] =
+  return compute_jac_adjoint_2d_tri(geometry_of(mesh), stiffnessFactor, stackedLocalStiffnessMatrix, driveJs, measPatterns)
@@ -0,0 +1,324 @@
+## 計算結果のディスクキャッシュ
+## 1. キーは入力(メッシュ形状、σ、J、正則化パラメータ等)のバイト列に対するFNV-1a(64bit)ハッシュ
+## 2. 行列はヘッダ + 行優先のfloat64(リトルエンディアン)の生データとして保存
+## 3. 読み込み時はmemfilesでmmapし、コピーせずにTensorとして参照する
+## 4. 再構成行列のキャッシュは合計がreconstructionCacheMaxBytesを超えないよう、最後に使われたのが古いものから削除する
+
+import std/[os, memfiles, strutils, times, algorithm]
+import arraymancer, results
+import mesh, geometry
+
+const
+  tensorFileMagic = "NEITTNS1"
+  meshFileMagic = "NEITMSH1"
+  tensorFileAlignment = 64
+  reconstructionCacheVersion = 1
+    ## ヤコビアンや再構成行列の計算方法を変えた場合はこれを上げて古いキャッシュを無効化する
+  reconstructionCacheMaxBytes* = 512*1024*1024
+    ## メッシュ毎の再構成行列のキャッシュの合計の上限
+
+type
+  ContentHash* = object
+    ## FNV-1a(64bit)
+    value*: uint64
+
+  MappedTensorFile* = object
+    ## mmapしたファイルとその上のTensor(ファイルを閉じるまで有効)
+    memFile: MemFile
+    tensors*: seq[Tensor[float]]
+
+func init_content_hash*(): ContentHash =
+  return ContentHash(value: 0xcbf29ce484222325'u64)
+
+proc add*(h: var ContentHash, data: pointer, size: int) =
+  let bytes = cast[ptr UncheckedArray[byte]](data)
+  for i in 0..<size:
+    h.value = (h.value xor bytes[i].uint64) * 0x100000001b3'u64
+
+proc add*(h: var ContentHash, x: int) =
+  var v = x.int64
+  h.add(v.addr, sizeof(v))
+
+proc add*(h: var ContentHash, x: float) =
+  var v = x
+  h.add(v.addr, sizeof(v))
+
+proc add*(h: var ContentHash, xs: seq[float]) =
+  h.add(len(xs))
+  if len(xs) > 0:
+    h.add(xs[0].unsafeAddr, sizeof(float)*len(xs))
+
+proc add*(h: var ContentHash, s: string) =
+  h.add(len(s))
+  if len(s) > 0:
+    h.add(s[0].unsafeAddr, len(s))
+
+proc add*(h: var ContentHash, geometry: MeshGeometry) =
+  ## メッシュの形状(頂点座標、エレメントの接続関係、外周頂点数)のみをハッシュに加える
+  h.add(geometry.numOuterVertices)
+  h.add(geometry.num_vertices)
+  for i in 0..<geometry.num_vertices:
+    h.add(geometry.x[i])
+    h.add(geometry.y[i])
+  h.add(geometry.num_elements)
+  for v in geometry.tri:
+    h.add(v.int)
+
+proc add*(h: var ContentHash, mesh: Mesh) =
+  h.add(geometry_of(mesh))
+
+func `$`*(h: ContentHash): string =
+  return toHex(h.value).toLowerAscii
+
+proc alignUp(x: int): int =
+  return ((x + tensorFileAlignment - 1) div tensorFileAlignment)*tensorFileAlignment
+
+proc save_tensors*(path: string, tensors: seq[Tensor[float]]): Result[void, CatchableError] =
+  ## ヘッダ: マジック(8byte)、テンソル数、各テンソルの(次元数、形状、データ開始位置)、いずれもint64
+  ## データ: 各テンソルを64byte境界から行優先のfloat64で格納
+  ## 書き込み途中のファイルを読まないよう、一時ファイルに書いてからリネームする
+  when cpuEndian != littleEndian:
+    return CatchableError(msg: "tensor file is supported only on little endian machines").err()
+
+  var
+    header: seq[int64]
+    headerSize = len(tensorFileMagic) + sizeof(int64)
+  for t in tensors:
+    headerSize += sizeof(int64)*(2 + t.rank)
+
+  var offset = alignUp(headerSize)
+  header.add(len(tensors).int64)
+  for t in tensors:
+    header.add(t.rank.int64)
+    for d in t.shape:
+      header.add(d.int64)
+    header.add(offset.int64)
+    offset = alignUp(offset + sizeof(float)*t.size)
+
+  let tmpPath = path & ".tmp"
+  try:
+    createDir(parentDir(path))
+    var f = open(tmpPath, fmWrite)
+    f.write(tensorFileMagic)
+    discard f.writeBuffer(header[0].addr, sizeof(int64)*len(header))
+    for t in tensors:
+      let
+        data = t.toFlatSeq
+        padding = newSeq[byte](alignUp(f.getFilePos.int) - f.getFilePos.int)
+      if len(padding) > 0:
+        discard f.writeBuffer(padding[0].unsafeAddr, len(padding))
+      if len(data) > 0:
+        discard f.writeBuffer(data[0].unsafeAddr, sizeof(float)*len(data))
+    f.close()
+    moveFile(tmpPath, path)
+  except CatchableError as e:
+    return CatchableError(msg: "failed to write " & path & ": " & e.msg).err()
+
+  return ok()
+
+proc close*(mapped: var MappedTensorFile) =
+  mapped.tensors.setLen(0)
+  mapped.memFile.close()
+
+proc read_int(base: ptr UncheckedArray[byte], size: int, pos: var int): int =
+  ## 範囲外であれば-1を返す(正当なヘッダに負の値は現れない)
+  if pos + sizeof(int64) > size:
+    return -1
+  result = cast[ptr int64](base[pos].addr)[].int
+  pos += sizeof(int64)
+
+proc open_tensors*(path: string): Result[MappedTensorFile, CatchableError] =
+  ## save_tensorsで保存したファイルをmmapし、データ領域をそのまま参照するTensorを作る
+  ## 返り値のTensorは close するまでの間のみ有効(読み取り専用)
+  if not fileExists(path):
+    return CatchableError(msg: path & " is not found").err()
+
+  var mapped: MappedTensorFile
+  try:
+    mapped.memFile = memfiles.open(path, mode = fmRead)
+  except CatchableError as e:
+    return CatchableError(msg: "failed to open " & path & ": " & e.msg).err()
+
+  let
+    size = mapped.memFile.size
+    base = cast[ptr UncheckedArray[byte]](mapped.memFile.mem)
+  var
+    pos = 0
+    magic = newString(len(tensorFileMagic))
+
+  if size >= len(magic):
+    copyMem(magic[0].addr, base[0].addr, len(magic))
+    pos = len(magic)
+  
+  var valid = magic == tensorFileMagic
+  let numTensors = if valid: read_int(base, size, pos) else: -1
+  valid = valid and numTensors >= 0
+  for i in 0..<max(numTensors, 0):
+    let rank = read_int(base, size, pos)
+    if rank < 0 or rank > (size - pos) div sizeof(int64):
+      valid = false
+      break
+    # 要素数・バイト数の計算が桁あふれしてファイルの範囲外を参照しないよう、掛ける前に上限と比べる
+    var
+      shape: seq[int]
+      count = 1
+    for d in 0..<rank:
+      shape.add(read_int(base, size, pos))
+      if shape[^1] < 0 or (shape[^1] > 0 and count > (high(int) div sizeof(float)) div shape[^1]):
+        valid = false
+        break
+      count *= shape[^1]
+    let offset = read_int(base, size, pos)
+    if not valid or offset < 0 or offset > size or offset mod sizeof(float) != 0 or count > (size - offset) div sizeof(float):
+      valid = false
+      break
+    mapped.tensors.add(fromBuffer[float](cast[pointer](base[offset].addr), shape))
+
+  if not valid:
+    mapped.close()
+    return CatchableError(msg: path & " is not a valid tensor file").err()
+
+  return mapped.ok()
+
+proc reconstruction_cache_key*(geometry: MeshGeometry, frame: Frame, α: float, p: float): string =
+  ## 再構成行列のキャッシュキー: メッシュ形状、σRef、J、V(ヤコビアンの計算に使う電位)、α、p
+  var h = init_content_hash()
+  h.add(reconstructionCacheVersion)
+  h.add(geometry)
+  for σ in frame.σRef:
+    h.add(σ)
+  for i in 0..<len(frame.V):
+    h.add(frame.J[i])
+    h.add(frame.V[i])
+  h.add(α)
+  h.add(p)
+  return $h
+
+proc reconstruction_cache_key*(mesh: Mesh, α: float, p: float): string =
+  return reconstruction_cache_key(geometry_of(mesh), frame_of(mesh), α, p)
+
+proc reconstruction_cache_path*(meshName: string, key: string): string =
+  return "data/" & meshName & "/cache/reconstruction_" & key & ".bin"
+
+proc touch_reconstruction_cache*(path: string) =
+  ## キャッシュを読み込んだ際に更新時刻を現在にし、削除の順序を最後に使われた順にする
+  try:
+    setLastModificationTime(path, getTime())
+  except OSError:
+    discard
+
+proc prune_reconstruction_cache*(meshName: string, maxBytes = reconstructionCacheMaxBytes) =
+  ## 再構成行列のキャッシュの合計がmaxBytesを超えていれば、更新時刻が古いものから削除する
+  var
+    files: seq[(Time, string, int)]
+    total = 0
+  for path in walkFiles("data/" & meshName & "/cache/reconstruction_*.bin"):
+    try:
+      files.add((getLastModificationTime(path), path, getFileSize(path).int))
+      total += files[^1][2]
+    except OSError:
+      continue
+  if total <= maxBytes:
+    return
+
+  files.sort(proc (a, b: (Time, string, int)): int = cmp(a[0], b[0]))
+  for (_, path, size) in files:
+    if total <= maxBytes:
+      break
+    if tryRemoveFile(path):
+      total -= size
+
+proc save_mesh*(path: string, mesh: Mesh, paramsHash: uint64): Result[void, CatchableError] =
+  ## メッシュをバイナリで保存
+  ## ヘッダ: マジック(8byte)、パラメータのハッシュ、外周頂点数、頂点数、エレメント数
+  ## データ: 頂点座標(float64*2*頂点数)、エレメント面積(float64*エレメント数)、頂点インデックス(int64*3*エレメント数)
+  when cpuEndian != littleEndian:
+    return CatchableError(msg: "mesh file is supported only on little endian machines").err()
+
+  var
+    header = @[cast[int64](paramsHash), mesh.numOuterVertices.int64, len(mesh.vertices).int64, len(mesh.elements).int64]
+    positions = newSeq[float](2*len(mesh.vertices))
+    areas = newSeq[float](len(mesh.elements))
+    triangles = newSeq[int64](3*len(mesh.elements))
+  for (i, vert) in mesh.vertices.pairs():
+    positions[2*i] = vert.pos[0]
+    positions[2*i + 1] = vert.pos[1]
+  for (i, elem) in mesh.elements.pairs():
+    areas[i] = elem.area
+    triangles[3*i] = elem.idxVertice1.int64
+    triangles[3*i + 1] = elem.idxVertice2.int64
+    triangles[3*i + 2] = elem.idxVertice3.int64
+
+  let tmpPath = path & ".tmp"
+  try:
+    createDir(parentDir(path))
+    var f = open(tmpPath, fmWrite)
+    f.write(meshFileMagic)
+    discard f.writeBuffer(header[0].addr, sizeof(int64)*len(header))
+    if len(positions) > 0:
+      discard f.writeBuffer(positions[0].addr, sizeof(float)*len(positions))
+    if len(areas) > 0:
+      discard f.writeBuffer(areas[0].addr, sizeof(float)*len(areas))
+    if len(triangles) > 0:
+      discard f.writeBuffer(triangles[0].addr, sizeof(int64)*len(triangles))
+    f.close()
+    moveFile(tmpPath, path)
+  except CatchableError as e:
+    return CatchableError(msg: "failed to write " & path & ": " & e.msg).err()
+
+  return ok()
+
+proc load_mesh*(path: string, paramsHash: uint64): Result[Mesh, CatchableError] =
+  ## save_meshで保存したメッシュをmmapして読み込む、パラメータのハッシュが一致しなければエラー
+  if not fileExists(path):
+    return CatchableError(msg: path & " is not found").err()
+
+  var memFile: MemFile
+  try:
+    memFile = memfiles.open(path, mode = fmRead)
+  except CatchableError as e:
+    return CatchableError(msg: "failed to open " & path & ": " & e.msg).err()
+  defer: memFile.close()
+
+  let
+    size = memFile.size
+    base = cast[ptr UncheckedArray[byte]](memFile.mem)
+  var
+    pos = 0
+    magic = newString(len(meshFileMagic))
+
+  if size >= len(magic):
+    copyMem(magic[0].addr, base[0].addr, len(magic))
+    pos = len(magic)
+  if magic != meshFileMagic:
+    return CatchableError(msg: path & " is not a valid mesh file").err()
+
+  let
+    storedHash = read_int(base, size, pos)
+    numOuterVertices = read_int(base, size, pos)
+    numVertices = read_int(base, size, pos)
+    numElements = read_int(base, size, pos)
+  # 頂点数・エレメント数はそれぞれ残りのバイト数で抑えてから掛け合わせ、桁あふれしないようにする
+  if numElements < 0 or numVertices < 0 or numOuterVertices < 0 or numOuterVertices > numVertices or
+     numVertices > (high(int) div sizeof(float)) div 2 or numElements > (high(int) div sizeof(float)) div 4 or
+     2*numVertices + 4*numElements > (size - pos) div sizeof(float):
+    return CatchableError(msg: path & " is not a valid mesh file").err()
+  if cast[uint64](storedHash) != paramsHash:
+    return CatchableError(msg: path & " was generated from different mesh parameters").err()
+
+  let
+    positions = cast[ptr UncheckedArray[float]](base[pos].addr)
+    areas = cast[ptr UncheckedArray[float]](base[pos + sizeof(float)*2*numVertices].addr)
+    triangles = cast[ptr UncheckedArray[int64]](base[pos + sizeof(float)*(2*numVertices + numElements)].addr)
+  var mesh = Mesh(numOuterVertices: numOuterVertices)
+  mesh.vertices = newSeq[Vertice2D](numVertices)
+  mesh.elements = newSeq[Element](numElements)
+  for i in 0..<numVertices:
+    mesh.vertices[i] = Vertice2D(pos: (positions[2*i], positions[2*i + 1]), V: 0.0, J: 0.0, isElectrode: i < numOuterVertices)
+  for i in 0..<numElements:
+    for k in 0..<3:
+      if triangles[3*i + k] < 0 or triangles[3*i + k].int >= numVertices:
+        return CatchableError(msg: path & " is not a valid mesh file (vertex index of element " & $i & " is out of range)").err()
+    mesh.elements[i] = Element(idxVertice1: triangles[3*i].int, idxVertice2: triangles[3*i + 1].int, idxVertice3: triangles[3*i + 2].int, area: areas[i])
+
+  return mesh.ok()
@@ -5,13 +5,16 @@ type
   SystemMode* = enum
     Forward,
     Backward,
+    Export,
+    Import,
+    Migrate,
     Quit,
   
 proc set_system_mode(): (SystemMode, bool) =
   ## bool: 新データを保存するかどうか
   while true:
     let mode_num = readLineFromStdin("Mode: ")
-    if mode_num != "0" and mode_num != "1" and mode_num != "2" and mode_num != "3":
+    if mode_num != "0" and mode_num != "1" and mode_num != "2" and mode_num != "3" and mode_num != "4" and mode_num != "5" and mode_num != "6":
       echo "Input is invalid, please try again"
     if mode_num == "1":
       return (Forward, false)
@@ -19,6 +22,12 @@ proc set_system_mode(): (SystemMode, bool) =
       return (Forward, true)
     if mode_num == "3":
       return (Backward, false)
+    if mode_num == "4":
+      return (Export, false)
+    if mode_num == "5":
+      return (Import, false)
+    if mode_num == "6":
+      return (Migrate, false)
     if mode_num == "0":
       return (Quit, false)
 
@@ -27,6 +36,9 @@ proc cli_navi*() =
   echo "1: forward-non-data-creation"
   echo "2: forward-data-creation"
   echo "3: backward"
+  echo "4: export-archive"
+  echo "5: import-archive"
+  echo "6: migrate-legacy-experiments"
   echo "0: exit"
 
   let
@@ -46,6 +58,24 @@ proc cli_navi*() =
       let
         meshName = readLineFromStdin("Mesh folder: ")
       backward_loop(meshName)
+
+    of Export:
+      echo "Export Mode"
+      let
+        meshName = readLineFromStdin("Mesh folder: ")
+      export_loop(meshName)
+
+    of Import:
+      echo "Import Mode"
+      let
+        meshName = readLineFromStdin("Mesh folder: ")
+      import_loop(meshName)
+
+    of Migrate:
+      echo "Migrate Mode"
+      let
+        meshName = readLineFromStdin("Mesh folder: ")
+      migrate_loop(meshName)
     
     of Quit:
       echo "Good bye!"
\ No newline at end of file
@@ -1,36 +1,324 @@
-import std/[rdstdin, strutils]
-import db_connector/db_sqlite
-import mesh
+import std/[rdstdin, strutils, tables, sets, sequtils, algorithm, times]
+import db_connector/db_sqlite, results
+from db_connector/sqlite3 import PStmt, SQLITE_OK, reset, clear_bindings, column_int64, column_double, column_text, column_blob, column_bytes
+import mesh, cache
 
-proc update_database*(mesh: Mesh, meshName: string) =
-  echo "Data is generated, updating database..."
-  let
-    experimentID = readLineFromStdin("Experiment id: ")
-    db = open("data/" & meshName & "/mesh.db", "", "", "")
+when cpuEndian != littleEndian:
+  # リトルエンディアンの環境ではBLOBをそのままコピーするため不要
+  import std/endians
 
-  echo "Writing database..."
-    
+const idChunkSize = 256
+  ## IN句に並べる実験IDの数
+  ## SQLiteの変数の数の上限(古い版では999)を超えないよう、実験IDはこの数ずつ問い合わせ、文は一度だけ準備して使い回す
+
+type
+  ExperimentRecord* = object
+    ## 1回の実験のデータ(エレメント毎のσRef、頂点毎のJ, V)
+    σRef*: seq[float]
+    J*: seq[float]
+    V*: seq[float]
+    patternID*: int
+    timestamp*: int64
+      ## 記録したUNIX時刻(秒)、以前の形式の表から読んだ場合は0
+
+proc create_tables(db: DbConn) =
+  ## 書き込み時のみ呼ぶ(表・索引の作成と列名の移行を行うため、読み込み専用のデータベースでは失敗し、書き込みロックも取る)
   db.exec(sql"""CREATE TABLE IF NOT EXISTS ElementTable (
                 ExperimentID INTEGER,
                 ElementID INTEGER,
                 σRef FLOAT
             )""")
-  
+
   db.exec(sql"""CREATE TABLE IF NOT EXISTS VerticeTable (
                 ExperimentID INTEGER,
                 VerticeID INTEGER,
-                I FLOAT,
+                J FLOAT,
                 V FLOAT
             )""")
 
-  for (i, elem) in mesh.elements.pairs():    
-    db.exec(sql"INSERT INTO ElementTable (ExperimentID, ElementID, σRef) VALUES (?, ?, ?)",
-      $experimentID.parseInt, $i, $elem.σRef)
+  # 以前のスキーマでは電流の列名が I だった(書き込み・読み込みは J を使うため揃える)
+  var columns: seq[string]
+  for row in db.fastRows(sql"PRAGMA table_info(VerticeTable)"):
+    columns.add(row[1])
+  if "I" in columns and "J" notin columns:
+    db.exec(sql"ALTER TABLE VerticeTable RENAME COLUMN I TO J")
+
+  # 1実験を1行とし、σRef・J・Vをfloat64(リトルエンディアン)を詰めたBLOBとして保存する
+  # MeshHashはメッシュ形状のハッシュ(別のメッシュの実験を読まないための確認用)、PatternIDは電流パターンの番号(0は設定ファイルの[Js])
+  db.exec(sql"""CREATE TABLE IF NOT EXISTS ExperimentBlobTable (
+                ExperimentID INTEGER PRIMARY KEY,
+                MeshHash TEXT,
+                PatternID INTEGER,
+                Timestamp INTEGER,
+                NumElements INTEGER,
+                NumVertices INTEGER,
+                σRef BLOB,
+                J BLOB,
+                V BLOB
+            )""")
+
+  # 実験IDで絞り込んで読むための索引(ID順に並んでいるため、ORDER BYもこの索引で済む)
+  db.exec(sql"CREATE INDEX IF NOT EXISTS ElementTableExperiment ON ElementTable (ExperimentID, ElementID)")
+  db.exec(sql"CREATE INDEX IF NOT EXISTS VerticeTableExperiment ON VerticeTable (ExperimentID, VerticeID)")
+
+proc has_table(db: DbConn, name: string): bool =
+  return db.getValue(sql"SELECT name FROM sqlite_master WHERE type = 'table' AND name = ?", name) != ""
 
-  for (i, vert) in mesh.vertices.pairs():    
-    db.exec(sql"INSERT INTO VerticeTable (ExperimentID, VerticeID, J, V) VALUES (?, ?, ?, ?)",
-      $experimentID.parseInt, $i, $vert.J, $vert.V)
+proc current_column(db: DbConn): string =
+  ## VerticeTableの電流の列名
+  ## 読み込みではスキーマを書き換えず、以前のスキーマ(列名 I)のままでも読めるようにする
+  for row in db.fastRows(sql"PRAGMA table_info(VerticeTable)"):
+    if row[1] == "J":
+      return "J"
+  return "I"
+
+proc enable_wal*(db: DbConn) =
+  ## WALモード: 書き込み中も読み込みを妨げず、コミット毎のfsyncを減らす(synchronous = NORMAL)
+  ## 設定はデータベースファイルに保存されるため、一度有効にすれば以降の接続でも有効
+  discard db.getValue(sql"PRAGMA journal_mode = WAL")
+  db.exec(sql"PRAGMA synchronous = NORMAL")
+
+proc mesh_hash*(mesh: Mesh): string =
+  var h = init_content_hash()
+  h.add(mesh)
+  return $h
+
+proc pack_floats(xs: openArray[float]): seq[byte] =
+  ## float64(リトルエンディアン)を詰めたバイト列
+  result = newSeq[byte](sizeof(float)*len(xs))
+  if len(xs) == 0:
+    return
+  when cpuEndian == littleEndian:
+    copyMem(result[0].addr, xs[0].unsafeAddr, len(result))
+  else:
+    for i in 0..<len(xs):
+      littleEndian64(result[sizeof(float)*i].addr, xs[i].unsafeAddr)
+
+proc unpack_floats(data: pointer, size: int, dest: var seq[float]): bool =
+  ## pack_floatsの逆、リトルエンディアンの環境ではdestへの一度のコピーのみ
+  ## バイト数が合わなければfalse
+  if size != sizeof(float)*len(dest):
+    return false
+  if len(dest) == 0:
+    return true
+  when cpuEndian == littleEndian:
+    copyMem(dest[0].addr, data, size)
+  else:
+    let bytes = cast[ptr UncheckedArray[byte]](data)
+    for i in 0..<len(dest):
+      littleEndian64(dest[i].addr, bytes[sizeof(float)*i].addr)
+  return true
+
+proc write_experiment*(db: DbConn, experimentID: int, record: ExperimentRecord, meshHash: string) =
+  ## 1回の実験をExperimentBlobTableの1行として書き込む
+  ## 同じ実験IDが既にあればDbError
+  let insertExperiment = db.prepare("INSERT INTO ExperimentBlobTable (ExperimentID, MeshHash, PatternID, Timestamp, NumElements, NumVertices, σRef, J, V) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)")
+  defer:
+    insertExperiment.finalize()
+  db.exec(insertExperiment, experimentID, meshHash, record.patternID, record.timestamp, len(record.σRef), len(record.J), pack_floats(record.σRef), pack_floats(record.J), pack_floats(record.V))
+
+proc write_experiments*(db: DbConn, records: openArray[(int, ExperimentRecord)], meshHash: string): Result[void, CatchableError] =
+  ## 複数の実験を1つのトランザクションで書き込む
+  ## いずれかの書き込みに失敗すれば(同じ実験IDが既にある場合を含む)ロールバックし、1つも書き込まない
+  db.create_tables()
+  let insertExperiment = db.prepare("INSERT INTO ExperimentBlobTable (ExperimentID, MeshHash, PatternID, Timestamp, NumElements, NumVertices, σRef, J, V) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)")
+  defer:
+    insertExperiment.finalize()
+
+  db.exec(sql"BEGIN")
+  try:
+    for (id, record) in records:
+      db.exec(insertExperiment, id, meshHash, record.patternID, record.timestamp, len(record.σRef), len(record.J), pack_floats(record.σRef), pack_floats(record.J), pack_floats(record.V))
+    db.exec(sql"COMMIT")
+  except DbError as e:
+    db.exec(sql"ROLLBACK")
+    return CatchableError(msg: "failed to write experiments: " & e.msg).err()
+  return ok()
+
+proc write_experiment*(db: DbConn, experimentID: int, mesh: Mesh, patternID = 0) =
+  ## メッシュの全エレメントのσRefと全頂点のJ, Vを、現在時刻の実験として書き込む
+  var record = ExperimentRecord(σRef: newSeq[float](len(mesh.elements)), J: newSeq[float](len(mesh.vertices)), V: newSeq[float](len(mesh.vertices)),
+                                patternID: patternID, timestamp: getTime().toUnix)
+  for (i, elem) in mesh.elements.pairs():
+    record.σRef[i] = elem.σRef
+  for (i, vert) in mesh.vertices.pairs():
+    record.J[i] = vert.J
+    record.V[i] = vert.V
+  db.write_experiment(experimentID, record, mesh_hash(mesh))
+
+proc update_database*(mesh: Mesh, meshName: string, walMode = false) =
+  echo "Data is generated, updating database..."
+  let
+    experimentID = readLineFromStdin("Experiment id: ")
+    db = open("data/" & meshName & "/mesh.db", "", "", "")
+
+  echo "Writing database..."
+
+  if walMode:
+    db.enable_wal()
+  db.create_tables()
+  db.write_experiment(experimentID.parseInt, mesh)
 
   echo "Database is updated"
 
-  db.close()
\ No newline at end of file
+  db.close()
+
+proc bind_id_chunk(ps: SqlPrepared, ids: seq[int], first: int) =
+  ## ids[first..<first + idChunkSize] をIN句の変数に束縛する
+  ## 足りない分は最後のIDで埋める(IN句なので重複しても結果は変わらない)
+  if reset(ps.PStmt) != SQLITE_OK or clear_bindings(ps.PStmt) != SQLITE_OK:
+    raise newException(DbError, "failed to reset a prepared statement")
+  for k in 0..<idChunkSize:
+    ps.bindParam(k + 1, ids[min(first + k, len(ids) - 1)])
+
+proc read_packed_experiments(db: DbConn, ids: seq[int], meshHash: string, records: var Table[int, ExperimentRecord]): Result[seq[int], CatchableError] =
+  ## ExperimentBlobTableにある実験を読み込み、読み込めた実験IDを返す
+  let placeholders = repeat("?", idChunkSize).join(", ")
+  var
+    found: seq[int]
+    selectExperiments = db.prepare("SELECT ExperimentID, MeshHash, σRef, J, V, PatternID, Timestamp FROM ExperimentBlobTable WHERE ExperimentID IN (" & placeholders & ")")
+  defer:
+    selectExperiments.finalize()
+
+  for first in countup(0, len(ids) - 1, idChunkSize):
+    selectExperiments.bind_id_chunk(ids, first)
+    for row in db.instantRows(selectExperiments):
+      let id = column_int64(row, 0).int
+      if meshHash != "" and $column_text(row, 1) != meshHash:
+        return CatchableError(msg: "experiment " & $id & " was recorded on a different mesh").err()
+      if not unpack_floats(column_blob(row, 2), column_bytes(row, 2), records[id].σRef) or
+         not unpack_floats(column_blob(row, 3), column_bytes(row, 3), records[id].J) or
+         not unpack_floats(column_blob(row, 4), column_bytes(row, 4), records[id].V):
+        return CatchableError(msg: "experiment " & $id & " does not match the mesh (size of the stored vectors differs)").err()
+      records[id].patternID = column_int64(row, 5).int
+      records[id].timestamp = column_int64(row, 6)
+      found.add(id)
+
+  return found.ok()
+
+proc read_row_experiments(db: DbConn, ids: seq[int], numElements: int, numVertices: int, records: var Table[int, ExperimentRecord]): Result[void, CatchableError] =
+  ## 以前の形式(エレメント・頂点毎に1行)のElementTable, VerticeTableから読み込む
+  if not db.has_table("ElementTable") or not db.has_table("VerticeTable"):
+    return CatchableError(msg: "experiments " & ids.join(", ") & " are not found").err()
+  let placeholders = repeat("?", idChunkSize).join(", ")
+  var
+    selectElements = db.prepare("SELECT ExperimentID, ElementID, σRef FROM ElementTable WHERE ExperimentID IN (" & placeholders & ") ORDER BY ExperimentID, ElementID")
+    selectVertices = db.prepare("SELECT ExperimentID, VerticeID, " & db.current_column & ", V FROM VerticeTable WHERE ExperimentID IN (" & placeholders & ") ORDER BY ExperimentID, VerticeID")
+    numElementRows = initTable[int, int]()
+    numVerticeRows = initTable[int, int]()
+  defer:
+    selectElements.finalize()
+    selectVertices.finalize()
+
+  for first in countup(0, len(ids) - 1, idChunkSize):
+    selectElements.bind_id_chunk(ids, first)
+    for row in db.instantRows(selectElements):
+      let
+        id = column_int64(row, 0).int
+        idx = column_int64(row, 1).int
+      if idx < 0 or idx >= numElements:
+        return CatchableError(msg: "ElementID " & $idx & " of experiment " & $id & " is out of range").err()
+      records[id].σRef[idx] = column_double(row, 2)
+      numElementRows.mgetOrPut(id, 0) += 1
+
+    selectVertices.bind_id_chunk(ids, first)
+    for row in db.instantRows(selectVertices):
+      let
+        id = column_int64(row, 0).int
+        idx = column_int64(row, 1).int
+      if idx < 0 or idx >= numVertices:
+        return CatchableError(msg: "VerticeID " & $idx & " of experiment " & $id & " is out of range").err()
+      records[id].J[idx] = column_double(row, 2)
+      records[id].V[idx] = column_double(row, 3)
+      numVerticeRows.mgetOrPut(id, 0) += 1
+
+  for id in ids:
+    if numElementRows.getOrDefault(id) != numElements or numVerticeRows.getOrDefault(id) != numVertices:
+      return CatchableError(msg: "experiment " & $id & " does not match the mesh (" & $numElementRows.getOrDefault(id) & " elements, " & $numVerticeRows.getOrDefault(id) & " vertices are stored)").err()
+
+  return ok()
+
+proc read_experiments*(db: DbConn, experimentIDs: seq[int], numElements: int, numVertices: int, meshHash = ""): Result[Table[int, ExperimentRecord], CatchableError] =
+  ## 指定した実験のみを読み込む
+  ## 1. ExperimentBlobTableにあればBLOBをそのままコピーする(meshHashを指定すれば記録時のメッシュと一致するか確認する)
+  ## 2. 無ければ以前の形式の表から、索引を使って(実験ID, エレメント/頂点ID)の順に読み込む(idChunkSize個の実験毎に1クエリ)
+  ##    値は文字列を介さずに整数・浮動小数点数として取り出す
+  ##    以前の形式の表は記録時のメッシュを持たず、メッシュ生成・頂点番号付けが変わると黙って別の頂点に対応してしまうため、
+  ##    meshHashを指定した場合は読まずにエラーとする(migrate_row_experimentsで記録時のメッシュを明示して移行する)
+  ## いずれかの実験のデータが欠けていればエラー
+  ## 読み込みのみで、表の作成やスキーマの変更は行わない
+  let ids = experimentIDs.sorted.deduplicate(isSorted = true)
+  var records: Table[int, ExperimentRecord]
+  for id in ids:
+    records[id] = ExperimentRecord(σRef: newSeq[float](numElements), J: newSeq[float](numVertices), V: newSeq[float](numVertices))
+  if len(ids) == 0:
+    return records.ok()
+
+  var packedIDs: HashSet[int]
+  if db.has_table("ExperimentBlobTable"):
+    let packed = db.read_packed_experiments(ids, meshHash, records)
+    if packed.isErr:
+      return packed.error.err()
+    packedIDs = packed.value.toHashSet
+
+  let rest = ids.filterIt(it notin packedIDs)
+  if len(rest) > 0:
+    if meshHash != "":
+      return CatchableError(msg: "experiments " & rest.join(", ") & " are not found in ExperimentBlobTable (experiments in the legacy tables have no mesh hash and must be migrated first)").err()
+    let rows = db.read_row_experiments(rest, numElements, numVertices, records)
+    if rows.isErr:
+      return rows.error.err()
+
+  return records.ok()
+
+proc existing_experiments*(db: DbConn, experimentIDs: seq[int]): seq[int] =
+  ## 指定した実験IDのうち、いずれかの表(ExperimentBlobTable、以前の形式のElementTable, VerticeTable)に既にあるもの(昇順)
+  ## 読み込みのみで、表が無ければその表は調べない
+  let ids = experimentIDs.sorted.deduplicate(isSorted = true)
+  if len(ids) == 0:
+    return
+  let placeholders = repeat("?", idChunkSize).join(", ")
+  var found: HashSet[int]
+  for table in ["ExperimentBlobTable", "ElementTable", "VerticeTable"]:
+    if not db.has_table(table):
+      continue
+    var selectIDs = db.prepare("SELECT DISTINCT ExperimentID FROM " & table & " WHERE ExperimentID IN (" & placeholders & ")")
+    try:
+      for first in countup(0, len(ids) - 1, idChunkSize):
+        selectIDs.bind_id_chunk(ids, first)
+        for row in db.instantRows(selectIDs):
+          found.incl(column_int64(row, 0).int)
+    finally:
+      selectIDs.finalize()
+  return toSeq(found).sorted
+
+proc migrate_row_experiments*(db: DbConn, experimentIDs: seq[int], mesh: Mesh): Result[seq[int], CatchableError] =
+  ## 以前の形式の表にある実験を、meshで記録したものとしてExperimentBlobTableに移し、移した実験IDを返す
+  ## 以前の形式の表にはメッシュの情報が無いため、記録時と同じメッシュ(頂点・エレメントの番号付けを含む)であることは呼び出し側が保証する
+  ## 既にExperimentBlobTableにある実験は移さない、以前の形式の表の行は削除しない
+  let ids = experimentIDs.sorted.deduplicate(isSorted = true)
+  var packedIDs: HashSet[int]
+  if db.has_table("ExperimentBlobTable") and len(ids) > 0:
+    let placeholders = repeat("?", idChunkSize).join(", ")
+    var selectIDs = db.prepare("SELECT ExperimentID FROM ExperimentBlobTable WHERE ExperimentID IN (" & placeholders & ")")
+    defer:
+      selectIDs.finalize()
+    for first in countup(0, len(ids) - 1, idChunkSize):
+      selectIDs.bind_id_chunk(ids, first)
+      for row in db.instantRows(selectIDs):
+        packedIDs.incl(column_int64(row, 0).int)
+
+  let legacyIDs = ids.filterIt(it notin packedIDs)
+  if len(legacyIDs) == 0:
+    return legacyIDs.ok()
+  let records = db.read_experiments(legacyIDs, len(mesh.elements), len(mesh.vertices))
+  if records.isErr:
+    return records.error.err()
+
+  var migrated: seq[(int, ExperimentRecord)]
+  for id in legacyIDs:
+    migrated.add((id, records.value[id]))
+  let written = db.write_experiments(migrated, mesh_hash(mesh))
+  if written.isErr:
+    return written.error.err()
+  return legacyIDs.ok()
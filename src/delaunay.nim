@@ -0,0 +1,191 @@
+## 隣接関係を保持したBowyer-Watson法によるドロネー三角形分割
+## 1. 新頂点を含む三角形を、直前に生成した三角形から隣接三角形を辿る(walk)ことで探索
+## 2. 新頂点を外接円内に含む三角形(キャビティ)を、含む三角形から隣接三角形を幅優先探索して収集
+## 3. キャビティの境界辺と新頂点を結んで再分割、削除した三角形の格納領域は再利用する
+## これにより1頂点あたりの計算量はキャビティの大きさ(+walkの距離)程度になる
+## 三角形は全て反時計回りに格納する
+
+import results
+import mesh, topology
+
+type
+  DelaunayTriangulation* = object
+    triangles*: seq[array[3, int]]
+    neighbours*: seq[array[3, int]]
+      ## neighbours[t][i]: 三角形tの頂点iの対辺を共有する三角形(無ければ-1)
+    alive*: seq[bool]
+    freeTriangles: seq[int]
+    lastTriangle: int
+    cavityStamp: seq[int]
+      ## キャビティに含まれる三角形の印(挿入毎に異なる値を使い、毎回の初期化を避ける)
+    stamp: int
+
+func orient(a: (float, float), b: (float, float), c: (float, float)): float =
+  ## 正: a->b->c が反時計回り
+  return (b[0] - a[0])*(c[1] - a[1]) - (b[1] - a[1])*(c[0] - a[0])
+
+func incircle(a: (float, float), b: (float, float), c: (float, float), d: (float, float)): float =
+  ## 正: dが反時計回りの三角形abcの外接円の内側にある
+  let
+    adx = a[0] - d[0]
+    ady = a[1] - d[1]
+    bdx = b[0] - d[0]
+    bdy = b[1] - d[1]
+    cdx = c[0] - d[0]
+    cdy = c[1] - d[1]
+    ad = adx*adx + ady*ady
+    bd = bdx*bdx + bdy*bdy
+    cd = cdx*cdx + cdy*cdy
+  return adx*(bdy*cd - bd*cdy) - ady*(bdx*cd - bd*cdx) + ad*(bdx*cdy - bdy*cdx)
+
+proc init_delaunay*(mesh: Mesh): Result[DelaunayTriangulation, CatchableError] =
+  ## 既存のメッシュ(generate_mesh_circleで作った初期メッシュ等)から隣接関係を構築
+  let topology = build_topology(mesh)
+  if topology.isErr:
+    return topology.error.err()
+
+  var dt: DelaunayTriangulation
+  for (t, elem) in mesh.elements.pairs():
+    var
+      tri = [elem.idxVertice1, elem.idxVertice2, elem.idxVertice3]
+      neighbours = [topology.value.neighbours[t][0].int, topology.value.neighbours[t][1].int, topology.value.neighbours[t][2].int]
+    # 時計回りの三角形は頂点を入れ替え、対辺の隣接三角形も合わせて入れ替える
+    if orient(mesh.vertices[tri[0]].pos, mesh.vertices[tri[1]].pos, mesh.vertices[tri[2]].pos) < 0:
+      swap(tri[1], tri[2])
+      swap(neighbours[1], neighbours[2])
+    dt.triangles.add(tri)
+    dt.neighbours.add(neighbours)
+    dt.alive.add(true)
+    dt.cavityStamp.add(0)
+
+  return dt.ok()
+
+proc locate(dt: DelaunayTriangulation, mesh: Mesh, p: (float, float)): int =
+  ## pを含む三角形を返す(見つからなければ-1)
+  ## 直前の三角形から、pが辺の外側にあればその辺の隣へ移動することを繰り返す
+  var t = dt.lastTriangle
+  if t >= len(dt.triangles) or not dt.alive[t]:
+    t = dt.alive.find(true)
+
+  for _ in 0..len(dt.triangles):
+    if t < 0:
+      break
+    var
+      outside = false
+      next = -1
+    for i in 0..<3:
+      let
+        a = mesh.vertices[dt.triangles[t][(i+1) mod 3]].pos
+        b = mesh.vertices[dt.triangles[t][(i+2) mod 3]].pos
+      if orient(a, b, p) < 0:
+        outside = true
+        next = dt.neighbours[t][i]
+        break
+    if not outside:
+      return t
+    t = next
+
+  # walkが外周に出た・巡回した場合は全探索
+  for t in 0..<len(dt.triangles):
+    if not dt.alive[t]:
+      continue
+    var inside = true
+    for i in 0..<3:
+      if orient(mesh.vertices[dt.triangles[t][(i+1) mod 3]].pos, mesh.vertices[dt.triangles[t][(i+2) mod 3]].pos, p) < 0:
+        inside = false
+    if inside:
+      return t
+  return -1
+
+proc insert_vertice*(dt: var DelaunayTriangulation, mesh: var Mesh, newVertice: Vertice2D): Result[void, CatchableError] =
+  ## 新頂点をmesh.verticesの末尾に加え、三角形分割を更新する
+  let
+    p = newVertice.pos
+    t0 = dt.locate(mesh, p)
+  if t0 < 0:
+    return CatchableError(msg: "new vertice (" & $p[0] & ", " & $p[1] & ") is outside of the mesh").err()
+
+  mesh.vertices.add(newVertice)
+  let idxNewVertice = len(mesh.vertices) - 1
+
+  # 1. 外接円内に新頂点を含む三角形を隣接関係に沿って幅優先探索
+  dt.stamp += 1
+  var cavity = @[t0]
+  dt.cavityStamp[t0] = dt.stamp
+  var head = 0
+  while head < len(cavity):
+    let t = cavity[head]
+    head += 1
+    for n in dt.neighbours[t]:
+      if n == -1 or dt.cavityStamp[n] == dt.stamp:
+        continue
+      let tri = dt.triangles[n]
+      if incircle(mesh.vertices[tri[0]].pos, mesh.vertices[tri[1]].pos, mesh.vertices[tri[2]].pos, p) > 0:
+        dt.cavityStamp[n] = dt.stamp
+        cavity.add(n)
+
+  # 2. キャビティの境界辺を収集
+  # 丸め誤差で新頂点から見て裏向きの境界辺ができた場合は、その辺を持つ三角形をキャビティから外してやり直す
+  var boundary: seq[(int, int, int)]
+  while true:
+    boundary.setLen(0)
+    var invalid = -1
+    for t in cavity:
+      for i in 0..<3:
+        let n = dt.neighbours[t][i]
+        if n == -1 or dt.cavityStamp[n] != dt.stamp:
+          let
+            a = dt.triangles[t][(i+1) mod 3]
+            b = dt.triangles[t][(i+2) mod 3]
+          if t != t0 and orient(mesh.vertices[a].pos, mesh.vertices[b].pos, p) <= 0:
+            invalid = t
+          boundary.add((a, b, n))
+    if invalid < 0:
+      break
+    dt.cavityStamp[invalid] = 0
+    cavity.delete(cavity.find(invalid))
+
+  # 3. キャビティの三角形を削除し、境界辺と新頂点から三角形を生成
+  for t in cavity:
+    dt.alive[t] = false
+    dt.freeTriangles.add(t)
+
+  var newTriangles: seq[int]
+  for (a, b, n) in boundary:
+    var t: int
+    if len(dt.freeTriangles) > 0:
+      t = dt.freeTriangles.pop()
+      dt.alive[t] = true
+    else:
+      t = len(dt.triangles)
+      dt.triangles.add([0, 0, 0])
+      dt.neighbours.add([-1, -1, -1])
+      dt.alive.add(true)
+      dt.cavityStamp.add(0)
+    dt.triangles[t] = [idxNewVertice, a, b]
+    dt.neighbours[t] = [n, -1, -1]
+    newTriangles.add(t)
+
+    # キャビティ外の隣接三角形からの参照を付け替え
+    if n != -1:
+      for j in 0..<3:
+        if dt.triangles[n][(j+1) mod 3] == b and dt.triangles[n][(j+2) mod 3] == a:
+          dt.neighbours[n][j] = t
+
+  # 新しい三角形同士の隣接関係(境界辺 a->b の三角形は、b から始まる辺と a で終わる辺の三角形に隣接)
+  for t in newTriangles:
+    for u in newTriangles:
+      if dt.triangles[u][1] == dt.triangles[t][2]:
+        dt.neighbours[t][1] = u
+      if dt.triangles[u][2] == dt.triangles[t][1]:
+        dt.neighbours[t][2] = u
+
+  dt.lastTriangle = newTriangles[0]
+  return ok()
+
+proc write_elements*(dt: DelaunayTriangulation, mesh: var Mesh) =
+  ## 有効な三角形をメッシュのエレメントとして書き出す
+  mesh.elements.setLen(0)
+  for (t, tri) in dt.triangles.pairs():
+    if dt.alive[t]:
+      mesh.elements.add(Element(idxVertice1: tri[0], idxVertice2: tri[1], idxVertice3: tri[2]))
@@ -7,9 +7,31 @@
 ## 7. 再構成アルゴリズムはヤコビアンを用いた差分再構成法であるため、順方向計算時にヤコビアンを計算可能にする
 ## 8. ヤコビアンJはエレメント毎に、 J[e] = R_e*K_e*V_e で求まる、詳しくはChatGPT様との会話参照
 ## 9. 一旦密行列計算で実装
+## 10. 疎行列(CSR)版の剛性行列と、前処理付き共役勾配法(PCG)による反復解法も用意
 
+import std/[math, sequtils]
 import arraymancer, results
-import mesh
+import mesh, geometry, sparse, sparse_cholesky, topology
+
+type
+  PreconditionerKind* = enum
+    Jacobi,
+    IncompleteCholesky,
+
+  Preconditioner* = object
+    case kind*: PreconditionerKind
+    of Jacobi:
+      invDiag*: seq[float]
+    of IncompleteCholesky:
+      factor*: CsrMatrix
+        ## IC(0)の下三角因子、各行の末尾が対角成分
+
+  PcgResult* = object
+    V*: seq[float]
+    iterations*: int
+    residual*: float
+      ## 相対残差 ||J - KV|| / ||J||
+    converged*: bool
 
 proc stiffness_mat_local_tri*(xy: Tensor[float], area: float): Result[Tensor[float], CatchableError] =
   ## 三角形エレメントにおける剛性行列K_ijの計算
@@ -25,20 +47,58 @@ proc stiffness_mat_local_tri*(xy: Tensor[float], area: float): Result[Tensor[flo
 
   return (edges*edges.transpose / (4.0*area)).ok()
 
-proc stack_stiffness_mat_local_tri*(mesh: Mesh): Result[Tensor[float], CatchableError] =
+proc stack_stiffness_mat_local_tri*(geometry: MeshGeometry): Result[Tensor[float], CatchableError] =
   ## 各三角形エレメントに対する局所剛性行列をスタックしてエレメント数*3*3の行列を得る
-  var localStiffnessMat = zeros[float]([len(mesh.elements), 3, 3])
-  
-  for (i, elem) in mesh.elements.pairs():
-    var xy = zeros[float]([3, 2])
-    xy[0, _] = [mesh.vertices[elem.idxVertice1].pos[0], mesh.vertices[elem.idxVertice1].pos[1]].toTensor
-    xy[1, _] = [mesh.vertices[elem.idxVertice2].pos[0], mesh.vertices[elem.idxVertice2].pos[1]].toTensor
-    xy[2, _] = [mesh.vertices[elem.idxVertice3].pos[0], mesh.vertices[elem.idxVertice3].pos[1]].toTensor
-  
-    localStiffnessMat[i, _] = stiffness_mat_local_tri(xy, elem.area).value().reshape(1, 3, 3)
-  
+  ## stiffness_mat_local_tri と同じ計算を、エレメント毎のTensorを作らずに座標配列から直接行う
+  let numElements = geometry.num_elements
+  var localStiffnessMat = zeros[float]([numElements, 3, 3])
+  if numElements == 0:
+    return localStiffnessMat.ok()
+
+  let pLocal = cast[ptr UncheckedArray[float]](localStiffnessMat.get_offset_ptr)
+  for e in 0..<numElements:
+    if geometry.area[e] <= 0.0:
+      return CatchableError(msg: "area of element " & $e & " must be positive").err()
+    let
+      v1 = geometry.tri[3*e]
+      v2 = geometry.tri[3*e + 1]
+      v3 = geometry.tri[3*e + 2]
+      # 各頂点の対辺ベクトル
+      ex = [geometry.x[v3] - geometry.x[v2], geometry.x[v1] - geometry.x[v3], geometry.x[v2] - geometry.x[v1]]
+      ey = [geometry.y[v3] - geometry.y[v2], geometry.y[v1] - geometry.y[v3], geometry.y[v2] - geometry.y[v1]]
+      scale = 1.0/(4.0*geometry.area[e])
+    for r in 0..<3:
+      for c in 0..<3:
+        pLocal[9*e + 3*r + c] = (ex[r]*ex[c] + ey[r]*ey[c])*scale
+
   return localStiffnessMat.ok()
 
+proc stack_stiffness_mat_local_tri*(mesh: Mesh): Result[Tensor[float], CatchableError] =
+  return stack_stiffness_mat_local_tri(geometry_of(mesh))
+
+proc scale_local_stiffness*(stackedLocalStiffnessMat: Tensor[float], σRef: seq[float]): Result[Tensor[float], CatchableError] =
+  ## 局所剛性行列にエレメント毎の伝導率を掛ける(形状のみに依存する局所剛性行列は計測間で使い回せる)
+  if stackedLocalStiffnessMat.rank != 3 or stackedLocalStiffnessMat.shape[0] != len(σRef):
+    return CatchableError(msg: "stackedLocalStiffnessMat's shape must be [len(σRef), 3, 3]").err()
+
+  var scaled = stackedLocalStiffnessMat.clone()
+  if len(σRef) == 0:
+    return scaled.ok()
+
+  let pScaled = cast[ptr UncheckedArray[float]](scaled.get_offset_ptr)
+  for e in 0..<len(σRef):
+    for k in 0..<9:
+      pScaled[9*e + k] *= σRef[e]
+
+  return scaled.ok()
+
+func idx_reference_vertice*(mesh: Mesh): int =
+  ## 電位基準点(外周上の θ = π/2 の位置)の頂点インデックス
+  return mesh.numOuterVertices div 4
+
+func idx_reference_vertice*(geometry: MeshGeometry): int =
+  return geometry.numOuterVertices div 4
+
 proc create_stiffness_mat*(mesh: Mesh, mat_local: Tensor[float]): Result[Tensor[float], CatchableError] =
   ## エレメント数*3*3の局所剛性行列をスタックさせた行列を、頂点数*頂点数の密行列にマッピング
   ## 電位基準点を外周上の θ = π/2 の位置に設定、その行と列に対応する要素の内対角成分以外を0に、対角成分を1に設定
@@ -53,11 +113,236 @@ proc create_stiffness_mat*(mesh: Mesh, mat_local: Tensor[float]): Result[Tensor[
       for c in 0..<3:
         stiffnessMatrix[idxVerts[r], idxVerts[c]] += mat_local[i, r, c]
 
-  let idxReferenceVertice = (mesh.numOuterVertices div 4)
+  let idxReferenceVertice = mesh.idx_reference_vertice
 
   
   stiffnessMatrix[idxReferenceVertice, _] = zeros_like(stiffnessMatrix[idxReferenceVertice, _])
   stiffnessMatrix[_, idxReferenceVertice] = zeros_like(stiffnessMatrix[_, idxReferenceVertice])
   stiffnessMatrix[idxReferenceVertice, idxReferenceVertice] = 1.0
   
-  return stiffnessMatrix.ok()
\ No newline at end of file
+  return stiffnessMatrix.ok()
+
+proc create_stiffness_mat_sparse*(mesh: Mesh, mat_local: Tensor[float]): Result[CsrMatrix, CatchableError] =
+  ## エレメント数*3*3の局所剛性行列を、エレメントの接続関係から非零パターンを決めたCSR形式の疎行列にマッピング
+  ## メモリは頂点数の2乗ではなく非零要素数(≒ 頂点数*7)に比例する
+  ## 電位基準点の行と列はパターンから対角成分以外を除外し、対角成分を1に設定(密行列版と同じ境界条件)
+  if mat_local.shape != [len(mesh.elements), 3, 3]:
+    return CatchableError(msg: "mat_local's shape must be [len(mesh.elements), 3, 3]").err()
+
+  let
+    numVertices = len(mesh.vertices)
+    idxReferenceVertice = mesh.idx_reference_vertice
+  
+  # 1. 頂点の隣接関係(辺)から非零パターンを構築、基準点の行と列は対角成分のみ残す
+  let topology = build_topology(mesh)
+  if topology.isErr:
+    return topology.error.err()
+
+  var pattern = topology.value.vertice_adjacency
+  pattern[idxReferenceVertice] = @[idxReferenceVertice]
+  for r in 0..<numVertices:
+    if r != idxReferenceVertice:
+      pattern[r].keepItIf(it != idxReferenceVertice)
+
+  var stiffnessMatrix = csr_from_pattern(numVertices, numVertices, pattern)
+
+  # 2. 局所剛性行列を加算(基準点に関わる成分は捨てる)
+  for (i, elem) in mesh.elements.pairs():
+    let idxVerts = [elem.idxVertice1, elem.idxVertice2, elem.idxVertice3]
+    for r in 0..<3:
+      if idxVerts[r] == idxReferenceVertice:
+        continue
+      for c in 0..<3:
+        if idxVerts[c] == idxReferenceVertice:
+          continue
+        stiffnessMatrix.values[stiffnessMatrix.find_entry(idxVerts[r], idxVerts[c])] += mat_local[i, r, c]
+
+  # 3. 基準点の対角成分
+  stiffnessMatrix.values[stiffnessMatrix.find_entry(idxReferenceVertice, idxReferenceVertice)] = 1.0
+
+  return stiffnessMatrix.ok()
+
+proc incomplete_cholesky*(stiffnessMat: CsrMatrix): Result[CsrMatrix, CatchableError] =
+  ## 剛性行列の下三角部分と同じ非零パターンに制限した不完全コレスキー分解 IC(0)
+  ## 対角成分が正にならない(分解が破綻する)場合は、正定値でない前処理を作らずにエラーを返す(呼び出し側でJacobiに切り替える)
+  if stiffnessMat.numRows != stiffnessMat.numCols:
+    return CatchableError(msg: "stiffnessMat must be square matrix!!").err()
+
+  let n = stiffnessMat.numRows
+  var
+    rowPtr = newSeq[int](n+1)
+    colIdx: seq[int]
+    values: seq[float]
+  
+  # 下三角部分(対角成分を含む)を抽出、列は昇順なので対角成分が各行の末尾に来る
+  for r in 0..<n:
+    for p in stiffnessMat.rowPtr[r]..<stiffnessMat.rowPtr[r+1]:
+      if stiffnessMat.colIdx[p] <= r:
+        colIdx.add(stiffnessMat.colIdx[p])
+        values.add(stiffnessMat.values[p])
+    if len(colIdx) == rowPtr[r] or colIdx[^1] != r:
+      return CatchableError(msg: "diagonal entry of row " & $r & " is not found").err()
+    rowPtr[r+1] = len(colIdx)
+
+  # 第i行の非零パターン上の位置
+  var position = newSeq[int](n)
+  for i in 0..<n:
+    position[i] = -1
+
+  for i in 0..<n:
+    let idxDiag = rowPtr[i+1] - 1
+    for p in rowPtr[i]..<rowPtr[i+1]:
+      position[colIdx[p]] = p
+
+    # L[i, k] = (A[i, k] - Σ_{j<k} L[i, j]*L[k, j]) / L[k, k]
+    for p in rowPtr[i]..<idxDiag:
+      let k = colIdx[p]
+      var s = values[p]
+      for q in rowPtr[k]..<rowPtr[k+1]-1:
+        if position[colIdx[q]] >= 0:
+          s -= values[position[colIdx[q]]]*values[q]
+      values[p] = s/values[rowPtr[k+1]-1]
+
+    # L[i, i] = sqrt(A[i, i] - Σ_{j<i} L[i, j]^2)
+    var s = values[idxDiag]
+    for p in rowPtr[i]..<idxDiag:
+      s -= values[p]^2
+    if s <= 0.0:
+      return CatchableError(msg: "incomplete Cholesky factorization breaks down at row " & $i).err()
+    values[idxDiag] = sqrt(s)
+
+    for p in rowPtr[i]..<rowPtr[i+1]:
+      position[colIdx[p]] = -1
+
+  return CsrMatrix(numRows: n, numCols: n, rowPtr: rowPtr, colIdx: colIdx, values: values).ok()
+
+proc create_preconditioner*(stiffnessMat: CsrMatrix, kind: PreconditionerKind): Result[Preconditioner, CatchableError] =
+  case kind
+    of Jacobi:
+      var invDiag = stiffnessMat.diagonal
+      for d in invDiag.mitems():
+        if d == 0.0:
+          return CatchableError(msg: "stiffnessMat has zero diagonal entry").err()
+        d = 1.0/d
+      return Preconditioner(kind: Jacobi, invDiag: invDiag).ok()
+    
+    of IncompleteCholesky:
+      let factor = incomplete_cholesky(stiffnessMat)
+      if factor.isErr:
+        return factor.error.err()
+      return Preconditioner(kind: IncompleteCholesky, factor: factor.value).ok()
+
+proc apply_preconditioner*(pre: Preconditioner, r: seq[float]): seq[float] =
+  ## z = M^-1 r
+  case pre.kind
+    of Jacobi:
+      result = newSeq[float](len(r))
+      for i in 0..<len(r):
+        result[i] = pre.invDiag[i]*r[i]
+
+    of IncompleteCholesky:
+      # L y = r (前進代入)
+      let L = pre.factor
+      var y = r
+      for i in 0..<L.numRows:
+        var s = y[i]
+        for p in L.rowPtr[i]..<L.rowPtr[i+1]-1:
+          s -= L.values[p]*y[L.colIdx[p]]
+        y[i] = s/L.values[L.rowPtr[i+1]-1]
+
+      # L^T z = y (後退代入、Lの行をL^Tの列として使う)
+      result = newSeq[float](len(r))
+      for i in countdown(L.numRows-1, 0):
+        result[i] = y[i]/L.values[L.rowPtr[i+1]-1]
+        for p in L.rowPtr[i]..<L.rowPtr[i+1]-1:
+          y[L.colIdx[p]] -= L.values[p]*result[i]
+
+func dot(a: seq[float], b: seq[float]): float =
+  for i in 0..<len(a):
+    result += a[i]*b[i]
+
+proc pcg*(stiffnessMat: CsrMatrix, J: seq[float], V0: seq[float], pre: Preconditioner, tol = 1e-10, maxIter = 1000): Result[PcgResult, CatchableError] =
+  ## 前処理付き共役勾配法で KV = J を解く
+  ## V0: 初期値(前フレームの電位を与えればwarm startになる)
+  ## tol: 相対残差の収束判定値
+  let n = stiffnessMat.numRows
+  if stiffnessMat.numCols != n:
+    return CatchableError(msg: "stiffnessMat must be square matrix!!").err()
+  if len(J) != n or len(V0) != n:
+    return CatchableError(msg: "lengths of J and V0 must be the size of stiffnessMat").err()
+  if (pre.kind == Jacobi and len(pre.invDiag) != n) or (pre.kind == IncompleteCholesky and pre.factor.numRows != n):
+    return CatchableError(msg: "preconditioner's size must be the size of stiffnessMat").err()
+
+  let normJ = sqrt(dot(J, J))
+  var
+    V = V0
+    KV = stiffnessMat * V
+    r = newSeq[float](len(J))
+  for i in 0..<len(J):
+    r[i] = J[i] - KV[i]
+
+  if normJ == 0.0:
+    # 右辺が0なら解も0
+    return PcgResult(V: newSeq[float](len(J)), iterations: 0, residual: 0.0, converged: true).ok()
+
+  var
+    z = pre.apply_preconditioner(r)
+    p = z
+    rz = dot(r, z)
+    residual = sqrt(dot(r, r))/normJ
+    iterations = 0
+
+  while residual > tol and iterations < maxIter:
+    let
+      Kp = stiffnessMat * p
+      pKp = dot(p, Kp)
+    if pKp <= 0.0:
+      return CatchableError(msg: "stiffnessMat is not positive definite (pᵀKp = " & $pKp & " at iteration " & $iterations & ")").err()
+    let α = rz/pKp
+    for i in 0..<len(V):
+      V[i] += α*p[i]
+      r[i] -= α*Kp[i]
+    z = pre.apply_preconditioner(r)
+    let rzNew = dot(r, z)
+    for i in 0..<len(p):
+      p[i] = z[i] + (rzNew/rz)*p[i]
+    rz = rzNew
+    residual = sqrt(dot(r, r))/normJ
+    iterations += 1
+
+  return PcgResult(V: V, iterations: iterations, residual: residual, converged: residual <= tol).ok()
+
+proc forward_pcg*(mesh: var Mesh, stiffnessMat: CsrMatrix, pre: Preconditioner, tol = 1e-10, maxIter = 1000): Result[PcgResult, CatchableError] =
+  ## メッシュの各頂点の J を右辺、現在の V(前フレームの電位)を初期値としてPCGで解き、V を更新する
+  ## 時系列でσが毎フレーム変わる場合でも、前フレームの解から数反復で収束する
+  var
+    J = newSeq[float](len(mesh.vertices))
+    V0 = newSeq[float](len(mesh.vertices))
+  for (i, vert) in mesh.vertices.pairs():
+    J[i] = vert.J
+    V0[i] = vert.V
+  
+  let solved = pcg(stiffnessMat, J, V0, pre, tol, maxIter)
+  if solved.isErr:
+    return solved.error.err()
+  for (i, vert) in mesh.vertices.mpairs():
+    vert.V = solved.value.V[i]
+  return solved
+
+proc adjacent_current_patterns*(mesh: Mesh, amplitude: float): Tensor[float] =
+  ## 隣接電極対に電流を流す計測プロトコルの全パターンを 頂点数*電極数 の行列として生成
+  ## 第k列: 電極kから+amplitude、電極k+1から-amplitudeを注入
+  let numElectrodes = mesh.numOuterVertices
+  result = zeros[float]([len(mesh.vertices), numElectrodes])
+  for k in 0..<numElectrodes:
+    result[k, k] = amplitude
+    result[(k+1) mod numElectrodes, k] = -amplitude
+
+proc forward_solve_patterns*(stiffnessFactor: CholeskyFactor, Js: Tensor[float]): Result[Tensor[float], CatchableError] =
+  ## 複数の電流注入パターンを多列の右辺としてまとめて解く
+  ## Js: 頂点数*パターン数、戻り値: 頂点数*パターン数の電位行列
+  ## 剛性行列の分解は一度だけで、全パターンで使い回す
+  if Js.rank != 2 or Js.shape[0] != stiffnessFactor.symbolic.n:
+    return CatchableError(msg: "Js's shape must be [len(mesh.vertices), numPatterns]").err()
+
+  return stiffnessFactor.solve(Js).ok()
@@ -0,0 +1,264 @@
+## 連続計測用の追記専用フレームストア(mesh.dbと同じディレクトリの frames.bin と索引 frames.idx)
+## 1. データファイル: 固定長(64byte)のヘッダの後に、固定長のフレームを並べる
+##    ヘッダ: マジック(8byte)、バージョン、メッシュ形状のハッシュ、電極数、チャンネル数、電流パターン数、値のバイト数、フレーム長、いずれもint64
+##    フレーム: 計測時刻(int64、UNIX時刻のナノ秒) + 値(パターン毎にチャンネル数個、float32またはfloat64)、8byte境界に揃える
+## 2. 索引ファイル: マジック(8byte)、コミット済みフレーム数(int64)、(64byteまで予約)、以降に各フレームの計測時刻(int64)
+## 3. 書き込み側(計測スレッド、1つのみ)はフレームと時刻を書いてから、コミット済みフレーム数をアトミックに(release)更新する
+##    読み込み側は(acquire)で読むため、ロック無しでもコミット済みのフレームは書き込みが完了している
+## 4. どちらのファイルもmemfilesでmmapし、読み込みは範囲を指定して解析せずにTensorへコピーする
+
+import std/[os, memfiles]
+import arraymancer, results
+
+const
+  frameStoreMagic = "NEITFRM1"
+  frameIndexMagic = "NEITIDX1"
+  frameStoreVersion = 1
+  frameStoreHeaderSize = 64
+  frameIndexHeaderSize = 64
+
+type
+  FrameValueKind* = enum
+    ## 値の型(値はバイト数)
+    fvFloat32 = 4
+    fvFloat64 = 8
+
+  FrameLayout* = object
+    meshHash*: uint64
+    numElectrodes*: int
+    numChannels*: int
+      ## 1パターンあたりの値の数(シミュレーションでは頂点数、実測では電極数)
+    numPatterns*: int
+      ## フレーム内の値は パターン*numChannels + チャンネル 番目
+    valueKind*: FrameValueKind
+
+  FrameStore* = object
+    ## 追記はopen_frame_store(path, layout)で開いた1つのFrameStoreからのみ行う
+    ## 読み込む側はそれぞれopen_frame_store(path)で開き、追記で増えたフレームはrefreshで見えるようになる
+    path*: string
+    layout*: FrameLayout
+    dataFile: MemFile
+    indexFile: MemFile
+    frameStride: int
+    capacity: int
+    writable: bool
+
+func index_path_of(path: string): string =
+  return changeFileExt(path, "idx")
+
+func frame_store_path*(meshName: string): string =
+  return "data/" & meshName & "/frames.bin"
+
+func num_values*(layout: FrameLayout): int =
+  return layout.numChannels*layout.numPatterns
+
+func frame_stride_of(layout: FrameLayout): int =
+  return sizeof(int64) + ((layout.valueKind.int*layout.num_values + 7) div 8)*8
+
+proc committed_ptr(store: FrameStore): ptr int64 =
+  return cast[ptr int64](cast[ptr UncheckedArray[byte]](store.indexFile.mem)[len(frameIndexMagic)].addr)
+
+proc frame_ptr(store: FrameStore, k: int): ptr UncheckedArray[byte] =
+  return cast[ptr UncheckedArray[byte]](cast[ptr UncheckedArray[byte]](store.dataFile.mem)[frameStoreHeaderSize + k*store.frameStride].addr)
+
+proc timestamps_ptr(store: FrameStore): ptr UncheckedArray[int64] =
+  return cast[ptr UncheckedArray[int64]](cast[ptr UncheckedArray[byte]](store.indexFile.mem)[frameIndexHeaderSize].addr)
+
+proc num_frames*(store: FrameStore): int =
+  ## コミット済みのフレーム数(このFrameStoreがmmapしている範囲まで)
+  let committed = atomicLoadN(store.committed_ptr, ATOMIC_ACQUIRE).int
+  return min(committed, store.capacity)
+
+proc close*(store: var FrameStore) =
+  if store.writable:
+    store.dataFile.flush()
+    store.indexFile.flush()
+  store.dataFile.close()
+  store.indexFile.close()
+  store.capacity = 0
+
+proc create_frame_store(path: string, layout: FrameLayout, capacity: int): Result[void, CatchableError] =
+  ## 空のフレームストアを作る
+  ## 作成途中のファイルを開かないよう、一時ファイルに書いてから索引、データの順にリネームする
+  let
+    header = @[frameStoreVersion.int64, cast[int64](layout.meshHash), layout.numElectrodes.int64, layout.numChannels.int64,
+               layout.numPatterns.int64, layout.valueKind.int64, layout.frame_stride_of.int64]
+    magic = frameStoreMagic
+    indexMagic = frameIndexMagic
+    tmpPath = path & ".tmp"
+    tmpIndexPath = index_path_of(path) & ".tmp"
+  try:
+    createDir(parentDir(path))
+    var
+      dataFile = memfiles.open(tmpPath, mode = fmReadWrite, newFileSize = frameStoreHeaderSize + capacity*layout.frame_stride_of)
+      indexFile = memfiles.open(tmpIndexPath, mode = fmReadWrite, newFileSize = frameIndexHeaderSize + capacity*sizeof(int64))
+    copyMem(dataFile.mem, magic[0].unsafeAddr, len(magic))
+    copyMem(cast[ptr UncheckedArray[byte]](dataFile.mem)[len(magic)].addr, header[0].unsafeAddr, sizeof(int64)*len(header))
+    copyMem(indexFile.mem, indexMagic[0].unsafeAddr, len(indexMagic))
+    dataFile.close()
+    indexFile.close()
+    moveFile(tmpIndexPath, index_path_of(path))
+    moveFile(tmpPath, path)
+  except CatchableError as e:
+    return CatchableError(msg: "failed to create " & path & ": " & e.msg).err()
+
+  return ok()
+
+proc map_frame_store(path: string, writable: bool): Result[FrameStore, CatchableError] =
+  ## データファイルと索引をmmapし、ヘッダを検証する
+  if not fileExists(path) or not fileExists(index_path_of(path)):
+    return CatchableError(msg: path & " is not found").err()
+
+  var store = FrameStore(path: path, writable: writable)
+  let mode = if writable: fmReadWrite else: fmRead
+  try:
+    store.dataFile = memfiles.open(path, mode = mode)
+  except CatchableError as e:
+    return CatchableError(msg: "failed to open " & path & ": " & e.msg).err()
+  try:
+    store.indexFile = memfiles.open(index_path_of(path), mode = mode)
+  except CatchableError as e:
+    store.dataFile.close()
+    return CatchableError(msg: "failed to open " & index_path_of(path) & ": " & e.msg).err()
+
+  var
+    magic = newString(len(frameStoreMagic))
+    indexMagic = newString(len(frameIndexMagic))
+    header: array[7, int64]
+  let valid = store.dataFile.size >= frameStoreHeaderSize and store.indexFile.size >= frameIndexHeaderSize
+  if valid:
+    copyMem(magic[0].addr, store.dataFile.mem, len(magic))
+    copyMem(indexMagic[0].addr, store.indexFile.mem, len(indexMagic))
+    copyMem(header[0].addr, cast[ptr UncheckedArray[byte]](store.dataFile.mem)[len(frameStoreMagic)].addr, sizeof(header))
+  if not valid or magic != frameStoreMagic or indexMagic != frameIndexMagic or header[0] != frameStoreVersion or
+     header[5] notin [fvFloat32.int64, fvFloat64.int64] or header[2] < 0 or header[3] < 0 or header[4] < 0:
+    store.close()
+    return CatchableError(msg: path & " is not a valid frame store").err()
+
+  store.layout = FrameLayout(meshHash: cast[uint64](header[1]), numElectrodes: header[2].int, numChannels: header[3].int,
+                             numPatterns: header[4].int, valueKind: FrameValueKind(header[5]))
+  store.frameStride = store.layout.frame_stride_of
+  if header[6] != store.frameStride.int64:
+    store.close()
+    return CatchableError(msg: path & " is not a valid frame store").err()
+  store.capacity = min((store.dataFile.size - frameStoreHeaderSize) div store.frameStride,
+                       (store.indexFile.size - frameIndexHeaderSize) div sizeof(int64))
+
+  return store.ok()
+
+proc open_frame_store*(path: string): Result[FrameStore, CatchableError] =
+  ## 読み込み用に開く
+  when cpuEndian != littleEndian:
+    return CatchableError(msg: "frame store is supported only on little endian machines").err()
+  return map_frame_store(path, writable = false)
+
+proc open_frame_store*(path: string, layout: FrameLayout, initialCapacity = 1024): Result[FrameStore, CatchableError] =
+  ## 追記用に開く、無ければ作る、既存のフレームストアとレイアウトが異なればエラー
+  when cpuEndian != littleEndian:
+    return CatchableError(msg: "frame store is supported only on little endian machines").err()
+
+  if not fileExists(path):
+    let created = create_frame_store(path, layout, max(initialCapacity, 1))
+    if created.isErr:
+      return created.error.err()
+
+  var store = map_frame_store(path, writable = true)
+  if store.isErr:
+    return store
+  if store.value.layout != layout:
+    store.value.close()
+    return CatchableError(msg: path & " was recorded with a different mesh or pattern layout").err()
+  return store
+
+proc refresh*(store: var FrameStore): Result[void, CatchableError] =
+  ## 読み込み側: 書き込み側が領域を拡張していれば開き直し、増えたフレームを読めるようにする
+  if store.writable or atomicLoadN(store.committed_ptr, ATOMIC_ACQUIRE).int <= store.capacity:
+    return ok()
+  store.close()
+  let reopened = map_frame_store(store.path, writable = false)
+  if reopened.isErr:
+    return reopened.error.err()
+  store = reopened.value
+  return ok()
+
+proc grow(store: var FrameStore, capacity: int) =
+  ## 索引、データの順に拡張する(読み込み側のmmapは元の大きさのまま有効)
+  store.indexFile.resize(frameIndexHeaderSize + capacity*sizeof(int64))
+  store.dataFile.resize(frameStoreHeaderSize + capacity*store.frameStride)
+  store.capacity = capacity
+
+proc append_frame*(store: var FrameStore, timestamp: int64, values: openArray[float]): Result[void, CatchableError] =
+  ## フレームを1つ追記する(ロックは使わない、同じFrameStoreに同時に追記してはいけない)
+  ## 領域が足りなければ2倍に拡張する
+  if not store.writable:
+    return CatchableError(msg: store.path & " is opened read-only").err()
+  if len(values) != store.layout.num_values:
+    return CatchableError(msg: "values' length must be numChannels*numPatterns").err()
+
+  let k = atomicLoadN(store.committed_ptr, ATOMIC_RELAXED).int
+  if k >= store.capacity:
+    try:
+      store.grow(2*max(store.capacity, 1))
+    except IOError, OSError:
+      return CatchableError(msg: "failed to grow " & store.path & ": " & getCurrentExceptionMsg()).err()
+
+  let frame = store.frame_ptr(k)
+  cast[ptr int64](frame)[] = timestamp
+  if len(values) > 0:
+    case store.layout.valueKind
+    of fvFloat64:
+      copyMem(frame[sizeof(int64)].addr, values[0].unsafeAddr, sizeof(float)*len(values))
+    of fvFloat32:
+      let dest = cast[ptr UncheckedArray[float32]](frame[sizeof(int64)].addr)
+      for i in 0..<len(values):
+        dest[i] = values[i].float32
+  store.timestamps_ptr[k] = timestamp
+
+  atomicStoreN(store.committed_ptr, (k + 1).int64, ATOMIC_RELEASE)
+  return ok()
+
+proc read_frames*(store: FrameStore, first: int, count: int): Result[Tensor[float], CatchableError] =
+  ## first番目からcount個のフレームの値(フレーム数*num_values)
+  if first < 0 or count < 0 or first + count > store.num_frames:
+    return CatchableError(msg: "frames " & $first & "..<" & $(first + count) & " are not committed (" & $store.num_frames & " frames)").err()
+
+  let numValues = store.layout.num_values
+  var frames = newTensor[float](count, numValues)
+  if count == 0 or numValues == 0:
+    return frames.ok()
+
+  let pFrames = cast[ptr UncheckedArray[float]](frames.get_offset_ptr)
+  for k in 0..<count:
+    let src = store.frame_ptr(first + k)
+    case store.layout.valueKind
+    of fvFloat64:
+      copyMem(pFrames[k*numValues].addr, src[sizeof(int64)].addr, sizeof(float)*numValues)
+    of fvFloat32:
+      let values = cast[ptr UncheckedArray[float32]](src[sizeof(int64)].addr)
+      for i in 0..<numValues:
+        pFrames[k*numValues + i] = values[i].float
+
+  return frames.ok()
+
+proc frame_timestamps*(store: FrameStore, first: int, count: int): Result[seq[int64], CatchableError] =
+  ## first番目からcount個のフレームの計測時刻(索引から読む)
+  if first < 0 or count < 0 or first + count > store.num_frames:
+    return CatchableError(msg: "frames " & $first & "..<" & $(first + count) & " are not committed (" & $store.num_frames & " frames)").err()
+
+  var timestamps = newSeq[int64](count)
+  if count > 0:
+    copyMem(timestamps[0].addr, store.timestamps_ptr[first].addr, sizeof(int64)*count)
+  return timestamps.ok()
+
+proc find_frame*(store: FrameStore, timestamp: int64): int =
+  ## 計測時刻がtimestamp以上の最初のフレーム(無ければnum_frames)、時刻は追記順に単調増加とする
+  var
+    lo = 0
+    hi = store.num_frames
+  while lo < hi:
+    let mid = (lo + hi) div 2
+    if store.timestamps_ptr[mid] < timestamp:
+      lo = mid + 1
+    else:
+      hi = mid
+  return lo
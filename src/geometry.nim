@@ -0,0 +1,121 @@
+## 形状(不変)と計測毎の状態を分離した配列構造(Struct of Arrays)のメッシュ
+## 1. MeshGeometry: 頂点座標 x[], y[]、接続関係 tri[3*エレメント数]、面積 area[] (メッシュ生成後は不変)
+## 2. Frame: 1回の計測(実験)に対応する J, V, ΔV (頂点毎) と σRef, Δσ, δσ (エレメント毎)
+## 複数のFrameが1つのMeshGeometryを共有でき、Meshを計測毎にコピーする必要がない
+## 各配列は連続領域なので、カーネルは構造体を辿らずに配列を順に読むだけで済む
+## 既存のMesh(AoS)とは geometry_of / frame_of / apply_frame で相互に変換する
+
+import std/[math]
+import results
+import mesh
+
+type
+  MeshGeometry* = object
+    numOuterVertices*: int
+    x*: seq[float]
+    y*: seq[float]
+    tri*: seq[int32]
+      ## エレメントeの頂点は tri[3*e], tri[3*e + 1], tri[3*e + 2]
+    area*: seq[float]
+
+  Frame* = object
+    J*: seq[float]
+    V*: seq[float]
+    ΔV*: seq[float]
+    σRef*: seq[float]
+    Δσ*: seq[float]
+    δσ*: seq[float]
+
+func num_vertices*(geometry: MeshGeometry): int =
+  return len(geometry.x)
+
+func num_elements*(geometry: MeshGeometry): int =
+  return len(geometry.area)
+
+func geometry_of*(mesh: Mesh): MeshGeometry =
+  let
+    numVertices = len(mesh.vertices)
+    numElements = len(mesh.elements)
+  result = MeshGeometry(numOuterVertices: mesh.numOuterVertices)
+  result.x = newSeq[float](numVertices)
+  result.y = newSeq[float](numVertices)
+  result.tri = newSeq[int32](3*numElements)
+  result.area = newSeq[float](numElements)
+  for (i, vert) in mesh.vertices.pairs():
+    result.x[i] = vert.pos[0]
+    result.y[i] = vert.pos[1]
+  for (e, elem) in mesh.elements.pairs():
+    result.tri[3*e] = elem.idxVertice1.int32
+    result.tri[3*e + 1] = elem.idxVertice2.int32
+    result.tri[3*e + 2] = elem.idxVertice3.int32
+    result.area[e] = elem.area
+
+func init_frame*(geometry: MeshGeometry): Frame =
+  ## Vertice2D, Element の初期値と同じ(σRef = 1、その他は0)
+  let
+    numVertices = geometry.num_vertices
+    numElements = geometry.num_elements
+  result.J = newSeq[float](numVertices)
+  result.V = newSeq[float](numVertices)
+  result.ΔV = newSeq[float](numVertices)
+  result.σRef = newSeq[float](numElements)
+  result.Δσ = newSeq[float](numElements)
+  result.δσ = newSeq[float](numElements)
+  for σ in result.σRef.mitems():
+    σ = 1.0
+
+func frame_of*(mesh: Mesh): Frame =
+  result.J = newSeq[float](len(mesh.vertices))
+  result.V = newSeq[float](len(mesh.vertices))
+  result.ΔV = newSeq[float](len(mesh.vertices))
+  result.σRef = newSeq[float](len(mesh.elements))
+  result.Δσ = newSeq[float](len(mesh.elements))
+  result.δσ = newSeq[float](len(mesh.elements))
+  for (i, vert) in mesh.vertices.pairs():
+    result.J[i] = vert.J
+    result.V[i] = vert.V
+    result.ΔV[i] = vert.ΔV
+  for (e, elem) in mesh.elements.pairs():
+    result.σRef[e] = elem.σRef
+    result.Δσ[e] = elem.Δσ
+    result.δσ[e] = elem.δσ
+
+proc apply_frame*(mesh: var Mesh, frame: Frame): Result[void, CatchableError] =
+  ## Frameの値をMeshに書き戻す(Meshを受け取る描画・データベース処理向け)
+  if len(frame.V) != len(mesh.vertices) or len(frame.σRef) != len(mesh.elements):
+    return CatchableError(msg: "frame's size does not match the mesh").err()
+
+  for (i, vert) in mesh.vertices.mpairs():
+    vert.J = frame.J[i]
+    vert.V = frame.V[i]
+    vert.ΔV = frame.ΔV[i]
+  for (e, elem) in mesh.elements.mpairs():
+    elem.σRef = frame.σRef[e]
+    elem.Δσ = frame.Δσ[e]
+    elem.δσ = frame.δσ[e]
+  return ok()
+
+func calculate_elements_area*(geometry: var MeshGeometry) =
+  for e in 0..<geometry.num_elements:
+    let
+      v1 = geometry.tri[3*e]
+      v2 = geometry.tri[3*e + 1]
+      v3 = geometry.tri[3*e + 2]
+    geometry.area[e] = 0.5*abs((geometry.x[v2] - geometry.x[v1])*(geometry.y[v3] - geometry.y[v1]) - (geometry.y[v2] - geometry.y[v1])*(geometry.x[v3] - geometry.x[v1]))
+
+func modify_σRef_circle_region*(geometry: MeshGeometry, frame: var Frame, centers: seq[(float, float)], Rs: seq[float], σRefs: seq[float]) =
+  ## Mesh版と同じく、重心が円内にあるエレメントのσRefを σRefs[i]/面積 に設定
+  for i in 0..<len(centers):
+    for e in 0..<geometry.num_elements:
+      let
+        v1 = geometry.tri[3*e]
+        v2 = geometry.tri[3*e + 1]
+        v3 = geometry.tri[3*e + 2]
+        x0 = (geometry.x[v1] + geometry.x[v2] + geometry.x[v3])/3
+        y0 = (geometry.y[v1] + geometry.y[v2] + geometry.y[v3])/3
+      if (x0 - centers[i][0])^2 + (y0 - centers[i][1])^2 <= Rs[i]^2:
+        frame.σRef[e] = σRefs[i]/geometry.area[e]
+
+func modify_J*(frame: var Frame, verts: seq[int], Js: seq[float]) =
+  for i in 0..<len(verts):
+    frame.J[verts[i]] = Js[i]
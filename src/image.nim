@@ -0,0 +1,97 @@
+## ブラウザを使わずに画像を保存する描画バックエンド
+## 1. 値を [下限, 上限] で0..255に量子化し、カラーマップのルックアップテーブル(LUT)でRGBに変換
+## 2. stb_image_write(nimbledeps/pkgs2/stb_image)でPNGとして直接保存
+## 3. 入力はラスタマップのgatherで得た平坦な配列(pixelX*解像度Y + pixelY 番目)、yは上向き
+##    有限でない値(描画領域外のInf等)は透明にする
+
+import std/[math]
+import arraymancer, results
+import stb_image/write
+
+type
+  ColormapLut* = array[256, array[3, uint8]]
+
+func lut_from_control_points(points: openArray[(float, float, float)]): ColormapLut =
+  ## 等間隔の制御点(0..1のRGB)を線形補間して256段階のLUTを作る
+  for k in 0..<256:
+    let
+      t = k.float/255.0*(len(points) - 1).float
+      i = min(int(floor(t)), len(points) - 2)
+      f = t - i.float
+    result[k] = [uint8(round(255.0*(points[i][0]*(1.0 - f) + points[i+1][0]*f))),
+                 uint8(round(255.0*(points[i][1]*(1.0 - f) + points[i+1][1]*f))),
+                 uint8(round(255.0*(points[i][2]*(1.0 - f) + points[i+1][2]*f)))]
+
+const
+  viridis* = lut_from_control_points([
+    (0.267, 0.005, 0.329), (0.283, 0.141, 0.458), (0.254, 0.265, 0.530),
+    (0.207, 0.372, 0.553), (0.164, 0.471, 0.558), (0.128, 0.567, 0.551),
+    (0.135, 0.659, 0.518), (0.267, 0.749, 0.441), (0.478, 0.821, 0.318),
+    (0.741, 0.873, 0.150), (0.993, 0.906, 0.144)])
+  grayscale* = lut_from_control_points([(0.0, 0.0, 0.0), (1.0, 1.0, 1.0)])
+
+func finite_range*(values: openArray[float]): (float, float) =
+  ## 有限な値の最小値と最大値(有限な値が無ければ(0, 0))
+  var
+    lo = Inf
+    hi = -Inf
+  for v in values:
+    if classify(v) notin {fcInf, fcNegInf, fcNan}:
+      lo = min(lo, v)
+      hi = max(hi, v)
+  if lo > hi:
+    return (0.0, 0.0)
+  return (lo, hi)
+
+proc colorize*(values: openArray[float], resolution: (int, int), valueRange: (float, float), lut: ColormapLut): seq[uint8] =
+  ## RGBA(上の行から順)の画素配列に変換
+  let
+    (lo, hi) = valueRange
+    scale = if hi > lo: 255.0/(hi - lo) else: 0.0
+  result = newSeq[uint8](4*resolution[0]*resolution[1])
+  for i in 0..<resolution[0]:
+    for j in 0..<resolution[1]:
+      let
+        v = values[i*resolution[1] + j]
+        offset = 4*((resolution[1] - 1 - j)*resolution[0] + i)
+      if classify(v) in {fcInf, fcNegInf, fcNan}:
+        continue
+      let color = lut[clamp(int(round((v - lo)*scale)), 0, 255)]
+      result[offset] = color[0]
+      result[offset + 1] = color[1]
+      result[offset + 2] = color[2]
+      result[offset + 3] = 255
+
+proc write_heatmap_png*(path: string, values: openArray[float], resolution: (int, int), valueRange: (float, float), lut = viridis): Result[void, CatchableError] =
+  if len(values) != resolution[0]*resolution[1]:
+    return CatchableError(msg: "values' length must be resolution[0]*resolution[1]").err()
+  if len(values) == 0:
+    return CatchableError(msg: "image is empty").err()
+
+  let pixels = colorize(values, resolution, valueRange, lut)
+  if not writePNG(path, resolution[0], resolution[1], RGBA, pixels):
+    return CatchableError(msg: "failed to write " & path).err()
+  return ok()
+
+proc write_heatmap_png*(path: string, values: openArray[float], resolution: (int, int), lut = viridis): Result[void, CatchableError] =
+  ## 値の範囲は有限な値の最小値・最大値
+  return write_heatmap_png(path, values, resolution, finite_range(values), lut)
+
+proc write_heatmap_pngs*(pathPrefix: string, images: Tensor[float32], resolution: (int, int), valueRange: (float, float), firstFrame = 0, lut = viridis): Result[void, CatchableError] =
+  ## gather_*_batch で書き込んだ画像(フレーム数*ピクセル数)を pathPrefix & "_<firstFrame + フレーム番号>.png" として保存
+  ## フレームを一定数ずつ処理しても全フレームで同じ色になるよう、値の範囲(例: 入力の値の finite_range)は呼び出し側で決める
+  let numPixels = resolution[0]*resolution[1]
+  if images.rank != 2 or images.shape[1] != numPixels or not images.is_C_contiguous:
+    return CatchableError(msg: "images' shape must be [numFrames, resolution[0]*resolution[1]] (C contiguous)").err()
+  if images.shape[0] == 0:
+    return ok()
+
+  let pImages = cast[ptr UncheckedArray[float32]](images.get_offset_ptr)
+  var frameValues = newSeq[float](numPixels)
+  for f in 0..<images.shape[0]:
+    for i in 0..<numPixels:
+      frameValues[i] = pImages[f*numPixels + i].float
+    let written = write_heatmap_png(pathPrefix & "_" & $(firstFrame + f) & ".png", frameValues, resolution, valueRange, lut)
+    if written.isErr:
+      return written
+  return ok()
@@ -1,6 +1,20 @@
-import std/[rdstdin, strutils, sequtils, os, random, tables]
+import std/[rdstdin, strutils, sequtils, os, random, tables, times]
 import arraymancer, db_connector/db_sqlite, results
-import setting, plotter, backward, mesh, database, toml
+import setting, plotter, forward, backward, mesh, geometry, spatial, database, framestore, archive, toml, sparse_cholesky, cache
+
+proc append_potentials(store: var FrameStore, layout: FrameLayout, Vs: Tensor[float]) =
+  ## 頂点数*パターン数の電位を、現在時刻の1フレームとしてフレームストアに追記する
+  var values = newSeq[float](layout.num_values)
+  for p in 0..<layout.numPatterns:
+    for c in 0..<layout.numChannels:
+      values[p*layout.numChannels + c] = Vs[c, p]
+  let
+    now = getTime()
+    appended = store.append_frame(now.toUnix*1_000_000_000 + now.nanosecond.int64, values)
+  if appended.isErr:
+    echo "Failed to append the frame: " & appended.error.msg
+  else:
+    echo "Frame " & $(store.num_frames - 1) & " is appended to the frame store"
 
 proc forward_loop*(preserve_data: bool, meshName: string, settingFileName: string) =
 
@@ -11,16 +25,22 @@ proc forward_loop*(preserve_data: bool, meshName: string, settingFileName: strin
     settingTomlPath = "data/" & meshName & "/" & settingFileName & ".toml"
     (centers, Rs, σRefs) = σRefs_from_toml(settingTomlPath).value()
     (verts, Js) = Js_from_toml(settingTomlPath).value()
+    (patternType, patternAmplitude) = current_patterns_from_toml(settingTomlPath).value()
 
   # Generate mesh
-  var mesh2d = generate_mesh(meshParams, drawVert = true, drawMesh = true)
+  var mesh2d = load_or_generate_mesh(meshName, meshParams, drawVert = true, drawMesh = true)
   
-  # Elements
-  mesh2d.modify_σRef_circle_region(centers, Rs, σRefs)
-  mesh2d.modify_J(verts, Js)
+  # Elements (円内のエレメントは空間索引で探す)
+  let
+    geometry = geometry_of(mesh2d)
+    grid = build_element_grid(geometry)
+  var frame = frame_of(mesh2d)
+  grid.modify_σRef_circle_region(geometry, frame, centers, Rs, σRefs)
+  frame.modify_J(verts, Js)
+  mesh2d.apply_frame(frame).value
 
   # Get stiffness matrices
-  var (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat, stiffness_mat) = get_stiffness_matrices(mesh2d)
+  var (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat, stiffness_mat) = get_sparse_stiffness_matrices(mesh2d)
   discard stackedLocalStiffnessMat
   discard unitStackedLocalStiffnessMat
 
@@ -34,13 +54,89 @@ proc forward_loop*(preserve_data: bool, meshName: string, settingFileName: strin
   for (i, vert) in mesh2d.vertices.pairs():
     J.add(vert.J)
   
-  let V = solve(stiffness_mat, J.toTensor)
+  # 設定ファイルの電流パターンを第0列とし、計測プロトコルが指定されていれば全パターンを列として追加
+  var JPatterns = J.toTensor.reshape(len(J), 1)
+  if patternType == "adjacent":
+    JPatterns = concat(JPatterns, adjacent_current_patterns(mesh2d, patternAmplitude), axis = 1)
+  elif patternType != "":
+    echo "Unknown pattern type: " & patternType & ", only the pattern in [Js] is solved"
+
+  let
+    stiffnessFactor = cholesky(stiffness_mat).value
+    Vs = forward_solve_patterns(stiffnessFactor, JPatterns).value
+  echo "Number of solved current patterns: " & $Vs.shape[1]
+
   for (i, vert) in mesh2d.vertices.mpairs():
-    vert.V = V[i]
+    vert.V = Vs[i, 0]
   
   draw_V(mesh2d, (1000, 1000), ((-meshParams.diameter, -meshParams.diameter), (meshParams.diameter, meshParams.diameter)))
 
-  if preserve_data: update_database(mesh2d, meshName)
+  var
+    store: FrameStore
+    hasStore = false
+    layout: FrameLayout
+  if preserve_data:
+    update_database(mesh2d, meshName, walMode = database_wal_from_toml(meshTomlPath).value())
+
+    # 全パターンの電位を1フレームとしてフレームストアにも追記する
+    var h = init_content_hash()
+    h.add(geometry)
+    layout = FrameLayout(meshHash: h.value, numElectrodes: mesh2d.numOuterVertices, numChannels: len(mesh2d.vertices), numPatterns: Vs.shape[1], valueKind: fvFloat64)
+    let opened = open_frame_store(frame_store_path(meshName), layout)
+    if opened.isErr:
+      echo "Failed to open the frame store: " & opened.error.msg
+    else:
+      store = opened.value
+      hasStore = true
+      store.append_potentials(layout, Vs)
+
+  # 時系列: [series]があれば、円領域を1フレーム毎にshiftだけ動かしたσについて順に解く
+  # σが毎フレーム変わるため剛性行列は組み立て直すが分解はせず、前フレームの電位を初期値とするPCGで数反復で収束させる
+  # 前処理はIC(0)、分解が破綻した場合はJacobiに切り替える
+  let (numSeriesFrames, shift) = series_from_toml(settingTomlPath).value()
+  var seriesVs = Vs.clone()
+  for k in 1..numSeriesFrames:
+    let movedCenters = centers.mapIt((it[0] + k.float*shift[0], it[1] + k.float*shift[1]))
+    var seriesFrame = init_frame(geometry)
+    grid.modify_σRef_circle_region(geometry, seriesFrame, movedCenters, Rs, σRefs)
+    seriesFrame.modify_J(verts, Js)
+    for j in 0..<geometry.num_vertices:
+      seriesFrame.V[j] = mesh2d.vertices[j].V
+    mesh2d.apply_frame(seriesFrame).value
+
+    let
+      scaledLocalStiffnessMat = scale_local_stiffness(stackedLocalStiffnessMat, seriesFrame.σRef).value
+      seriesStiffnessMat = create_stiffness_mat_sparse(mesh2d, scaledLocalStiffnessMat).value
+    var pre = create_preconditioner(seriesStiffnessMat, IncompleteCholesky)
+    if pre.isErr:
+      echo "Frame " & $k & ": " & pre.error.msg & ", using the Jacobi preconditioner"
+      pre = create_preconditioner(seriesStiffnessMat, Jacobi)
+
+    # パターン0はメッシュのJ, V(前フレームの電位)から、その他のパターンは前フレームの同じ列を初期値として解く
+    let solved = mesh2d.forward_pcg(seriesStiffnessMat, pre.value).value
+    var
+      iterations = solved.iterations
+      maxResidual = solved.residual
+      converged = solved.converged
+    for j in 0..<geometry.num_vertices:
+      seriesVs[j, 0] = solved.V[j]
+    for p in 1..<seriesVs.shape[1]:
+      let patternSolved = pcg(seriesStiffnessMat, JPatterns[_, p].toFlatSeq, seriesVs[_, p].toFlatSeq, pre.value).value
+      iterations += patternSolved.iterations
+      maxResidual = max(maxResidual, patternSolved.residual)
+      converged = converged and patternSolved.converged
+      for j in 0..<geometry.num_vertices:
+        seriesVs[j, p] = patternSolved.V[j]
+    echo "Frame " & $k & ": " & $iterations & " PCG iterations for " & $seriesVs.shape[1] & " patterns, max relative residual " & $maxResidual & (if converged: "" else: " (not converged)")
+
+    if hasStore:
+      store.append_potentials(layout, seriesVs)
+
+  if hasStore:
+    store.close()
+
+  if numSeriesFrames > 0:
+    draw_V(mesh2d, (1000, 1000), ((-meshParams.diameter, -meshParams.diameter), (meshParams.diameter, meshParams.diameter)))
 
 
 proc backward_loop*(meshName: string) =
@@ -51,7 +147,12 @@ proc backward_loop*(meshName: string) =
     meshParams = mesh_params_from_toml(meshTomlPath).value()
   
   # Generate mesh
-  var mesh2d = generate_mesh(meshParams, drawVert = false, drawMesh = false)
+  var mesh2d = load_or_generate_mesh(meshName, meshParams, drawVert = false, drawMesh = false)
+
+  # 形状は全ての計測で共通なので、形状のみに依存する局所剛性行列は一度だけ計算する
+  let
+    geometry = geometry_of(mesh2d)
+    stackedLocalStiffnessMat = stack_stiffness_mat_local_tri(geometry).value
   
   # Read input 
   var inputTomlName = readLineFromStdin("Input .toml file name: ")
@@ -68,37 +169,79 @@ proc backward_loop*(meshName: string) =
     echo "length of experimentID (1st/2nd) is not same, check it again"
     return
 
+  # 必要な実験のみを一度に読み込む
+  echo "Reading database..."
+  var h = init_content_hash()
+  h.add(geometry)
+  let
+    db = open("data/" & meshName & "/mesh.db", "", "", "")
+    records = db.read_experiments(experimentIDs0 & experimentIDs1, geometry.num_elements, geometry.num_vertices, $h).value
+  db.close()
+
+  # 比較する(基準, 計測)の組
+  var pairs: seq[(ExperimentRecord, ExperimentRecord)]
+  for i in 0..<len(experimentIDs0):
+    pairs.add((records[experimentIDs0[i]], records[experimentIDs1[i]]))
+
+  # [frames]があれば、1stExperimentIDsの先頭を基準としてフレームストアの各フレーム(パターン0の電位)と組にする
+  # フレームの真の伝導率は分からないため基準と同じとする(RMSは推定した変化の大きさになる)
+  # [patterns]で隣接電極プロトコルを指定した場合は、フレームを全パターンの電位として随伴場のヤコビアンで再構成する
+  var (firstFrame, numFrames, sinceTimestamp) = frames_from_toml("data/" & meshName & "/" & inputTomlName & ".toml").value()
+  let
+    (patternType, patternAmplitude) = current_patterns_from_toml("data/" & meshName & "/" & inputTomlName & ".toml").value()
+    adjacentFrames = numFrames > 0 and patternType == "adjacent"
+  var frames: Tensor[float]
+  if numFrames > 0:
+    if len(experimentIDs0) == 0:
+      echo "1stExperimentIDs is needed as the reference of frames"
+      return
+    var store = open_frame_store(frame_store_path(meshName)).value
+    if store.layout.meshHash != h.value or store.layout.numChannels != geometry.num_vertices:
+      echo "Frame store was recorded on a different mesh, check it again"
+      store.close()
+      return
+    if adjacentFrames and store.layout.numPatterns != 1 + geometry.numOuterVertices:
+      echo "Frame store does not have all the adjacent patterns, check [patterns] of the forward setting"
+      store.close()
+      return
+    # 開いた後に書き込み側(forward_loop)が領域を拡張していても、それまでに追記されたフレームを読めるようにする
+    let refreshed = store.refresh()
+    if refreshed.isErr:
+      echo "Failed to refresh the frame store: " & refreshed.error.msg
+      store.close()
+      return
+    if sinceTimestamp >= 0:
+      firstFrame = store.find_frame(sinceTimestamp)
+    if firstFrame + numFrames > store.num_frames:
+      echo "Only " & $store.num_frames & " frames are in the frame store, frames " & $firstFrame & "..<" & $(firstFrame + numFrames) & " are requested"
+      store.close()
+      return
+    echo "Reading frames " & $firstFrame & "..<" & $(firstFrame + numFrames) & " from the frame store..."
+    frames = store.read_frames(firstFrame, numFrames).value
+    store.close()
+
+  if numFrames > 0 and not adjacentFrames:
+    let reference = records[experimentIDs0[0]]
+    for k in 0..<numFrames:
+      var measured = ExperimentRecord(σRef: reference.σRef, J: reference.J, V: newSeq[float](geometry.num_vertices))
+      for j in 0..<geometry.num_vertices:
+        measured.V[j] = frames[k, j]
+      pairs.add((reference, measured))
+
   var
     δσs: seq[seq[float]]
 
-  for i in 0..<len(experimentIDs0):
-    let
-      experimentID0 = experimentIDs0[i]
-      experimentID1 = experimentIDs1[i]
+  for i in 0..<len(pairs):
     var
-      J: seq[float]
-      V0: seq[float]
-      V1: seq[float]
-      σ0: seq[float]
-      σ1: seq[float]
-
-    echo "Reading database..."
-    let db = open("data/" & meshName & "/mesh.db", "", "", "")
-
-    for row in db.fastRows(sql"SELECT ExperimentID, σRef FROM ElementTable"):
-      if row[0].parseInt == experimentID0:
-        σ0.add(row[1].parseFloat)
-      if row[0].parseInt == experimentID1:
-        σ1.add(row[1].parseFloat)
-
-    for row in db.fastRows(sql"SELECT ExperimentID, J, V FROM VerticeTable"):
-      if row[0].parseInt == experimentID0:
-        J.add(row[1].parseFloat)
-        V0.add(row[2].parseFloat)
-      if row[0].parseInt == experimentID1:
-        V1.add(row[2].parseFloat)
+      J = pairs[i][0].J
+      V0 = pairs[i][0].V
+      V1 = pairs[i][1].V
+      σ0 = pairs[i][0].σRef
+      σ1 = pairs[i][1].σRef
 
     # ノイズの導入(ここじゃなくてメッシュ本体に直接加算すべきかもしれない、伝導率も同じく)
+    # ノイズは実行毎に異なり再構成行列を再利用できないため、ノイズを加えた場合はキャッシュを使わない
+    var noisy = false
     var errors = intentional_error_from_toml("data/" & meshName & "/" & inputTomlName & ".toml").value()
     for error in errors.keys():
       if error == "Vs":
@@ -107,6 +250,7 @@ proc backward_loop*(meshName: string) =
             mu = errors["Vs"]["mu"].parseFloat
             sigma = errors["Vs"]["sigma"].parseFloat
           echo "Add gaussian noise to voltages..."
+          noisy = true
           for V in V0.mitems():
             V = V + gauss(mu = mu, sigma = sigma)
           for V in V1.mitems():
@@ -119,47 +263,158 @@ proc backward_loop*(meshName: string) =
             mu = errors["σs"]["mu"].parseFloat
             sigma = errors["σs"]["sigma"].parseFloat
           echo "Add gaussian noise to voltages..."
+          noisy = true
           for σ in σ0.mitems():
             σ = σ + gauss(mu = mu, sigma = sigma)
           for σ in σ1.mitems():
             σ = σ + gauss(mu = mu, sigma = sigma)
 
-    db.close()
-  
-    for (j, elem) in mesh2d.elements.mpairs():
-      elem.σRef = σ0[j]
-      elem.Δσ = σ1[j] - σ0[j]
-    for (j, vert) in mesh2d.vertices.mpairs():
-      vert.J = J[j]
-      vert.V = V0[j]
-      vert.ΔV = V1[j] - V0[j]
-
-    # Get stiffness matrices
-    var (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat, stiffness_mat) = get_stiffness_matrices(mesh2d)
-    discard stackedLocalStiffnessMat
-
-    # Backward-1. Calculate jacobian from global / local stiffness matrix and outer node's voltages
-    let jac = mesh2d.compute_jac_2d_tri(stiffness_mat, unitStackedLocalStiffnessMat).value
-
-    # Backward-2. Converge RMS based on differential re-construction method with regularization term
+    # 計測毎の状態はFrameに格納し、メッシュ(形状)は共有する
+    var frame = init_frame(geometry)
+    for j in 0..<geometry.num_elements:
+      frame.σRef[j] = σ0[j]
+      frame.Δσ[j] = σ1[j] - σ0[j]
+    for j in 0..<geometry.num_vertices:
+      frame.J[j] = J[j]
+      frame.V[j] = V0[j]
+      frame.ΔV[j] = V1[j] - V0[j]
+
+    # 同じメッシュ・σRef・J・V・正則化パラメータで計算済みであれば、キャッシュから再構成行列を読み込む
+    # キャッシュのファイルが壊れている・形状が合わない場合は計算し直す
     let
-      coef = jac.δσ_over_δV().value
-      δσ = mesh2d.reconstruct_δσ(coef).value
+      α = 1.0
+      p = 1.0
+      cachePath = reconstruction_cache_path(meshName, reconstruction_cache_key(geometry, frame, α, p))
+      numOuterVertices = geometry.numOuterVertices
+    var
+      loaded = false
+      cached: MappedTensorFile
+      coef: Tensor[float]
+
+    if not noisy:
+      let opened = open_tensors(cachePath)
+      if opened.isOk:
+        cached = opened.value
+        if len(cached.tensors) == 2 and cached.tensors[0].shape == [numOuterVertices, geometry.num_elements] and
+           cached.tensors[1].shape == [geometry.num_elements, numOuterVertices]:
+          loaded = true
+        else:
+          echo "Reconstruction matrix cache has unexpected shapes, recomputing..."
+          cached.close()
+
+    if loaded:
+      echo "Reconstruction matrix is loaded from cache"
+      coef = cached.tensors[1]
+      touch_reconstruction_cache(cachePath)
+    else:
+      # Get stiffness matrices
+      let
+        unitStackedLocalStiffnessMat = scale_local_stiffness(stackedLocalStiffnessMat, frame.σRef).value
+        stiffness_mat = create_stiffness_mat_sparse(mesh2d, unitStackedLocalStiffnessMat).value
+
+      # Backward-1. Calculate jacobian from factorized global / local stiffness matrix and outer node's voltages
+      let
+        stiffnessFactor = cholesky(stiffness_mat).value
+        jac = compute_jac_2d_tri(geometry, frame, stiffnessFactor, unitStackedLocalStiffnessMat).value
+
+      # Backward-2. Converge RMS based on differential re-construction method with regularization term
+      coef = jac.δσ_over_δV(α, p).value
+
+      if not noisy:
+        let saved = save_tensors(cachePath, @[jac, coef])
+        if saved.isErr:
+          echo "Failed to save the reconstruction matrix cache: " & saved.error.msg
+        prune_reconstruction_cache(meshName)
+
+    let δσ = reconstruct_δσ(geometry, frame, coef).value
+    if loaded:
+      # coefはmmapした領域を参照しているため、使い終わってから閉じる
+      cached.close()
 
     var RMS = 0.0
-    for (j, elem) in mesh2d.elements.mpairs():
-      elem.δσ = δσ[j]
-      RMS += sqrt((elem.Δσ - elem.δσ)^2)
-    RMS = RMS/len(mesh2d.elements).float
+    for j in 0..<geometry.num_elements:
+      frame.δσ[j] = δσ[j]
+      RMS += sqrt((frame.Δσ[j] - frame.δσ[j])^2)
+    RMS = RMS/geometry.num_elements.float
 
     echo "RMS(" & $i & "): " & $RMS
     
     # Backward-3. Get the reconstructed image !
     δσs.add(δσ.toSeq1D)      
     
-    draw_δσ(mesh2d, (1000, 1000), ((-meshParams.diameter, -meshParams.diameter), (meshParams.diameter, meshParams.diameter)))
-  
-  
+    # フレームはまとめてPNGに保存する(下記)
+    if i < len(experimentIDs0):
+      mesh2d.apply_frame(frame).value
+      draw_δσ(mesh2d, (1000, 1000), ((-meshParams.diameter, -meshParams.diameter), (meshParams.diameter, meshParams.diameter)))
+
+  if adjacentFrames:
+    # 注入パターン: 第0列は基準の[Js]、第1列以降は隣接電極対(forward_loopでフレームに書いた順)
+    # 計測パターン: 隣接電極間の差電圧
+    # ヤコビアンと再構成行列は基準のσのみに依存するため、分解とともに一度だけ計算して全フレームで共有する
+    # (σsのノイズはフレーム毎に異なるヤコビアンが必要になるため、この経路では加えない)
+    let
+      α = 1.0
+      p = 1.0
+      reference = records[experimentIDs0[0]]
+      numVertices = geometry.num_vertices
+      unitStackedLocalStiffnessMat = scale_local_stiffness(stackedLocalStiffnessMat, reference.σRef).value
+      stiffnessFactor = cholesky(create_stiffness_mat_sparse(mesh2d, unitStackedLocalStiffnessMat).value).value
+      driveJs = concat(reference.J.toTensor.reshape(numVertices, 1), adjacent_current_patterns(mesh2d, patternAmplitude), axis = 1)
+      measPatterns = adjacent_measurement_patterns(mesh2d)
+      jac = compute_jac_adjoint_2d_tri(geometry, stiffnessFactor, unitStackedLocalStiffnessMat, driveJs, measPatterns).value
+      coef = jac.δσ_over_δV(α, p).value
+      referenceVs = forward_solve_patterns(stiffnessFactor, driveJs).value
+      numDrive = driveJs.shape[1]
+      errors = intentional_error_from_toml("data/" & meshName & "/" & inputTomlName & ".toml").value()
+      noisyVs = errors.hasKey("Vs") and errors["Vs"]["type"] == "Gaussian"
+    echo "Reconstructing " & $numFrames & " frames with " & $jac.shape[0] & " measurements..."
+
+    for k in 0..<numFrames:
+      # フレームの値は values[パターン*頂点数 + 頂点] の順
+      var
+        V0 = referenceVs.clone()
+        V1 = newTensor[float](numVertices, numDrive)
+      for d in 0..<numDrive:
+        for v in 0..<numVertices:
+          V1[v, d] = frames[k, d*numVertices + v]
+      if noisyVs:
+        let
+          mu = errors["Vs"]["mu"].parseFloat
+          sigma = errors["Vs"]["sigma"].parseFloat
+        V0.apply_inline(x + gauss(mu = mu, sigma = sigma))
+        V1.apply_inline(x + gauss(mu = mu, sigma = sigma))
+
+      # 計測 m^T ΔU は 計測数*注入数、ヤコビアンの行の順(d*計測数 + m)に並べ替える
+      let
+        δv = (measPatterns.transpose*(V1 - V0)).transpose.clone().reshape(jac.shape[0])
+        δσ = coef*δv
+
+      # フレームの真の伝導率は分からないため基準と同じとする(RMSは推定した変化の大きさになる)
+      var frame = init_frame(geometry)
+      var RMS = 0.0
+      for j in 0..<geometry.num_elements:
+        frame.σRef[j] = reference.σRef[j]
+        frame.δσ[j] = δσ[j]
+        RMS += sqrt((frame.Δσ[j] - frame.δσ[j])^2)
+      RMS = RMS/geometry.num_elements.float
+      echo "RMS(frame " & $(firstFrame + k) & "): " & $RMS
+
+      δσs.add(δσ.toSeq1D)
+
+  if numFrames > 0:
+    # フレームは1枚ずつplotlyで描かず、一定数ずつラスタマップで画像にしてPNGに保存する(値の範囲は全フレームで共通)
+    # 電位はパターン0の基準からの変化、δσはいずれの経路でもδσsの末尾numFrames個がフレームのもの
+    let
+      drawingArea = ((-meshParams.diameter, -meshParams.diameter), (meshParams.diameter, meshParams.diameter))
+      referenceV = records[experimentIDs0[0]].V.toTensor.reshape(1, geometry.num_vertices)
+    echo "Drawing " & $numFrames & " frames..."
+    draw_V_frames(geometry, frames[_, 0..<geometry.num_vertices] -. referenceV, (1000, 1000), drawingArea, firstFrame)
+    draw_δσ_frames(geometry, δσs[len(δσs) - numFrames..^1].toTensor, (1000, 1000), drawingArea, firstFrame)
+
+  if len(δσs) == 0:
+    echo "Nothing is reconstructed"
+    return
+
   var δσ_mean = repeat(0.0, len(δσs[0]))
   for j in 0..<len(δσs[0]):
     for i in 0..<len(δσs):
@@ -176,3 +431,53 @@ proc backward_loop*(meshName: string) =
   draw_Δσ(mesh2d, (1000, 1000), ((-meshParams.diameter, -meshParams.diameter), (meshParams.diameter, meshParams.diameter)))
   draw_δσ(mesh2d, (1000, 1000), ((-meshParams.diameter, -meshParams.diameter), (meshParams.diameter, meshParams.diameter)), title = "δσ_mean(mean of estimated conductivities change)")
   
+
+
+proc export_loop*(meshName: string) =
+  ## メッシュ、指定した実験、フレームストアのフレームを圧縮アーカイブにする
+  let
+    meshParams = mesh_params_from_toml("data/" & meshName & "/mesh.toml").value()
+    mesh2d = load_or_generate_mesh(meshName, meshParams, drawVert = false, drawMesh = false)
+    archivePath = readLineFromStdin("Archive path: ")
+    experimentIDs = readLineFromStdin("Experiment ids (comma separated): ").split(',').filterIt(it.strip != "").mapIt(it.strip.parseInt)
+    firstFrameInput = readLineFromStdin("First frame: ").strip
+    numFramesInput = readLineFromStdin("Number of frames: ").strip
+    firstFrame = if firstFrameInput == "": 0 else: firstFrameInput.parseInt
+    numFrames = if numFramesInput == "": 0 else: numFramesInput.parseInt
+
+  echo "Writing archive..."
+  let summary = export_archive(archivePath, meshName, mesh2d, experimentIDs, (firstFrame, numFrames))
+  if summary.isErr:
+    echo "Failed to export: " & summary.error.msg
+    return
+  echo $summary.value.numExperiments & " experiments and " & $summary.value.numFrames & " frames are exported to " & archivePath
+
+
+proc import_loop*(meshName: string) =
+  ## 圧縮アーカイブを展開し、実験をmesh.dbに、フレームをフレームストアに追加する
+  let archivePath = readLineFromStdin("Archive path: ")
+
+  echo "Reading archive..."
+  let summary = import_archive(archivePath, meshName)
+  if summary.isErr:
+    echo "Failed to import: " & summary.error.msg
+    return
+  echo $summary.value.numExperiments & " experiments and " & $summary.value.numFrames & " frames are imported to data/" & meshName
+
+
+proc migrate_loop*(meshName: string) =
+  ## 以前の形式(エレメント・頂点毎に1行)の実験を、現在のメッシュで記録したものとしてExperimentBlobTableに移す
+  ## メッシュ生成・番号付けを変える前に記録した実験は頂点の対応が異なるため、記録時と同じメッシュであることを確認してから実行する
+  let
+    meshParams = mesh_params_from_toml("data/" & meshName & "/mesh.toml").value()
+    mesh2d = load_or_generate_mesh(meshName, meshParams, drawVert = false, drawMesh = false)
+    experimentIDs = readLineFromStdin("Experiment ids (comma separated): ").split(',').filterIt(it.strip != "").mapIt(it.strip.parseInt)
+
+  echo "Migrating experiments..."
+  let db = open("data/" & meshName & "/mesh.db", "", "", "")
+  defer: db.close()
+  let migrated = db.migrate_row_experiments(experimentIDs, mesh2d)
+  if migrated.isErr:
+    echo "Failed to migrate: " & migrated.error.msg
+    return
+  echo $len(migrated.value) & " experiments are migrated to the current mesh"
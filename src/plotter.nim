@@ -1,6 +1,6 @@
-import sequtils, math
-import plotly, chroma
-import mesh, calc
+import std/[sequtils, os, json, math]
+import plotly, chroma, arraymancer, results
+import mesh, geometry, topology, raster, image
 
 proc draw_vertices*(mesh: Mesh) = 
   ## メッシュの頂点を描画
@@ -31,427 +31,152 @@ proc draw_vertices*(mesh: Mesh) =
 
 proc draw_mesh*(mesh: Mesh) = 
   ## エレメントを描画
+  ## トポロジーの重複の無い辺を、辺毎に区切り(null)を挟んだ1本のトレースとして描画する
+  ## (エレメント毎にトレースを作ると大きなメッシュでHTMLが肥大化するため)
   const colors = @[Color(r: 0.0, g: 0.0, b:0.0, a: 0.0)]
   let
     layout = Layout(title: "mesh", width: 600, height: 600,
                       xaxis: Axis(title: "x"),
                       yaxis: Axis(title: "y"), 
                       autosize:false)
+    topology = build_topology(mesh)
+  if topology.isErr:
+    echo "Failed to draw mesh: " & topology.error.msg
+    return
+
   var
     p = Plot[float](layout:layout)
+    d = Trace[float](mode: PlotMode.Lines, `type`: PlotType.Scatter)
+    xs = newSeqOfCap[float](3*len(topology.value.edges))
+    ys = newSeqOfCap[float](3*len(topology.value.edges))
+  d.marker = Marker[float](size: @[16.float], color: colors)
+
+  # 区切りは一旦NaNとして入れ、JSONに変換してからnullに置き換える
+  for edge in topology.value.edges.items():
+    xs.add(mesh.vertices[edge[0]].pos[0])
+    xs.add(mesh.vertices[edge[1]].pos[0])
+    xs.add(NaN)
+    ys.add(mesh.vertices[edge[0]].pos[1])
+    ys.add(mesh.vertices[edge[1]].pos[1])
+    ys.add(NaN)
 
-  for element in mesh.elements.items():
-    let
-      d = Trace[float](mode: PlotMode.Lines, `type`: PlotType.Scatter)
-      size = @[16.float]
-    d.marker = Marker[float](size: size, color: colors)
-    
-    var
-      xs: seq[float]
-      ys: seq[float]
-      x1 = mesh.vertices[element.idxVertice1].pos[0]
-      y1 = mesh.vertices[element.idxVertice1].pos[1]
-      x2 = mesh.vertices[element.idxVertice2].pos[0]
-      y2 = mesh.vertices[element.idxVertice2].pos[1]
-      x3 = mesh.vertices[element.idxVertice3].pos[0]
-      y3 = mesh.vertices[element.idxVertice3].pos[1]
-
-    xs.add(x1)
-    xs.add(x2)
-    xs.add(x3)
-    xs.add(x1)
-    ys.add(y1)
-    ys.add(y2)
-    ys.add(y3)
-    ys.add(y1)
-
-    d.xs = xs
-    d.ys = ys
-    
-    p = p.addTrace(d)
+  d.xs = xs
+  d.ys = ys
+  p = p.addTrace(d)
 
-  p.show()
+  var plotJson = p.toPlotJson
+  for trace in plotJson.traces.items():
+    for axis in ["x", "y"]:
+      if trace.hasKey(axis):
+        let values = trace[axis]
+        for i in 0..<len(values):
+          if values[i].kind == JFloat and values[i].getFloat.isNaN:
+            values.elems[i] = newJNull()
+
+  plotJson.show()
+
+type
+  PlotBackend* = enum
+    Plotly,
+      ## plotlyで保存(HTML/JSONを経由し、ブラウザが必要)
+    Png
+      ## stb_image_writeでPNGを直接保存(GUIの無い環境でも可)
+
+const defaultPlotBackend* = when defined(headlessPlot): Png else: Plotly
+  ## -d:headlessPlot を付けてコンパイルするとヒートマップはPNGで保存される
+
+proc draw_heatmap(values: seq[float], resolution: (int, int), title: string, fileName: string, backend: PlotBackend) =
+  ## ピクセル毎の値(pixelX*解像度Y + pixelY の平坦な配列)をヒートマップとして保存
+  ## Pngの場合は拡張子を.pngに置き換えたファイルに保存
+  if backend == Png:
+    let
+      pngName = fileName.changeFileExt("png")
+      written = write_heatmap_png(pngName, values, resolution)
+    if written.isErr:
+      echo "Failed to draw " & title & ": " & written.error.msg
+    return
 
-proc draw_V*(mesh: Mesh, resolution: (int, int), drawingArea: ((float, float), (float, float))) =
-  ## 1. 3つの頂点から1組のベクトルを作って外積計算、法線ベクトルを算出し電位方程式を導出
-  ## 2. 対象のエレメント中にheatmapの描画対象のある点(x, y)が含まれるかを判定
-    ## AABBで捜索範囲を制限
-    ## 制限された範囲の中の各ピクセル座標について、エレメントの頂点から任意の2組のベクトルを選択
-    ## 選択されたベクトルとピクセル座標から内積を通じて角度を導出し、領域内にあるかどうかを確認
-  ## 3. 描画対象に含まれる場合、座標を電位方程式に代入して電位を算出し格納
-  
-  # const colors = @[Color(r: 0.0, g: 0.0, b:0.0, a: 0.4)]
   let
-    layout = Layout(title: "voltages", width: 600, height: 600,
+    layout = Layout(title: title, width: 600, height: 600,
                       xaxis: Axis(title: "x"),
                       yaxis: Axis(title: "y"), 
                       autosize: false)
-    # 計算精度の都合上と思われる電位計算時の導出ヌケを防ぐために意図的に小さな値を加算
-    epsilon = 1e-8
-  
   var
-    xs = newSeq[float](resolution[0])
-    ys = newSeq[float](resolution[1])
     colors: seq[Color]
     d = Trace[float](mode: PlotMode.Lines, `type`: PlotType.HeatMap)
     size = @[16.float]
-  
-  d.zs = newSeqWith(resolution[0], newSeq[float](resolution[1]))
-  
-  # ヒートマップのマス目の座標の定義(左下を基準としている)
-  for i in 0..<resolution[0]:
-    xs[i] = drawingArea[0][0] + i.toFloat*(drawingArea[1][0] - drawingArea[0][0])/resolution[0].toFloat
-  for i in 0..<resolution[1]:
-    ys[i] = drawingArea[0][1] + i.toFloat*(drawingArea[1][1] - drawingArea[0][1])/resolution[1].toFloat
-  
-  # 電位方程式の計算
-  for elem in mesh.elements.items():
-    let
-      vert1 = mesh.vertices[elem.idxVertice1]
-      vert2 = mesh.vertices[elem.idxVertice2]
-      vert3 = mesh.vertices[elem.idxVertice3]
-    
-    # 外積計算をするベクトルの決定
-    var
-      vecA: (float, float, float)
-      vecB: (float, float, float)
-      vecC: (float, float, float)
-      vecA_start: Vertice2D
-      vecA_end: Vertice2D
-
-    # 最もx座標が大きいノードを外積計算の2ベクトルの始点に指定
-    if vert1.pos[0] > vert2.pos[0]:
-      if vert1.pos[0] > vert3.pos[0]:
-        vecA = (vert2.pos[0] - vert1.pos[0], vert2.pos[1] - vert1.pos[1], vert2.V - vert1.V)
-        vecB = (vert3.pos[0] - vert1.pos[0], vert3.pos[1] - vert1.pos[1], vert3.V - vert1.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert1
-        vecA_end = vert2
-      else:
-        vecA = (vert1.pos[0] - vert3.pos[0], vert1.pos[1] - vert3.pos[1], vert1.V - vert3.V)
-        vecB = (vert2.pos[0] - vert3.pos[0], vert2.pos[1] - vert3.pos[1], vert2.V - vert3.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert3
-        vecA_end = vert1
-    else:
-      if vert2.pos[0] > vert3.pos[0]:
-        vecA = (vert3.pos[0] - vert2.pos[0], vert3.pos[1] - vert2.pos[1], vert3.V - vert2.V)
-        vecB = (vert1.pos[0] - vert2.pos[0], vert1.pos[1] - vert2.pos[1], vert1.V - vert2.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert2
-        vecA_end = vert3
-      else:
-        vecA = (vert1.pos[0] - vert3.pos[0], vert1.pos[1] - vert3.pos[1], vert1.V - vert3.V)
-        vecB = (vert2.pos[0] - vert3.pos[0], vert2.pos[1] - vert3.pos[1], vert2.V - vert3.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert3
-        vecA_end = vert1
-    
-    # 法線ベクトル(一次近似の電位方程式の係数ベクトル)算出(向きは考慮しない)
-    let normVec = cross(vecA, vecB)
 
-    # 捜索範囲としてのAABB(Axis-Aligned Bounding Box)の定義
-    let
-      AABB0 = (min(min(vert1.pos[0], vert2.pos[0]), vert3.pos[0]), min(min(vert1.pos[1], vert2.pos[1]), vert3.pos[1]))
-      AABB1 = (max(max(vert1.pos[0], vert2.pos[0]), vert3.pos[0]), max(max(vert1.pos[1], vert2.pos[1]), vert3.pos[1]))
-    
-    # AABBのピクセル値取得
-    let
-      AABB0pixelX = int(resolution[0].toFloat*(AABB0[0] - drawingArea[0][0])/(drawingArea[1][0] - drawingArea[0][0]))
-      AABB0pixelY = int(resolution[1].toFloat*(AABB0[1] - drawingArea[0][1])/(drawingArea[1][1] - drawingArea[0][1]))
-      AABB1pixelX = int(resolution[0].toFloat*(AABB1[0] - drawingArea[0][0])/(drawingArea[1][0] - drawingArea[0][0]))
-      AABB1pixelY = int(resolution[1].toFloat*(AABB1[1] - drawingArea[0][1])/(drawingArea[1][1] - drawingArea[0][1]))
-      
-    # 電位描画
-    for pixelX in AABB0pixelX..min(AABB1pixelX, resolution[0]-1):
-      for pixelY in AABB0pixelY..min(AABB1pixelY, resolution[1]-1):
-        # 内積の大小から角度の大小関係を確認、エレメント内に対象の座標が居るかを確認
-        let pos = (xs[pixelX], ys[pixelY])
-        var
-          posA: (float, float)
-          posB: (float, float)
-
-        if vecA_start == vert1:
-          posA = (xs[pixelX] - vert1.pos[0], ys[pixelY] - vert1.pos[1])
-        if vecA_start == vert2:
-          posA = (xs[pixelX] - vert2.pos[0], ys[pixelY] - vert2.pos[1])
-        if vecA_start == vert3:
-          posA = (xs[pixelX] - vert3.pos[0], ys[pixelY] - vert3.pos[1])
-        
-        if vecA_end == vert1:
-          posB = (xs[pixelX] - vert1.pos[0], ys[pixelY] - vert1.pos[1])
-        if vecA_end == vert2:
-          posB = (xs[pixelX] - vert2.pos[0], ys[pixelY] - vert2.pos[1])
-        if vecA_end == vert3:
-          posB = (xs[pixelX] - vert3.pos[0], ys[pixelY] - vert3.pos[1])
-
-        if epsilon + dot(posA, (vecA[0], vecA[1]))/(norm(posA)*norm((vecA[0], vecA[1]))) >= dot((vecB[0], vecB[1]), (vecA[0], vecA[1]))/(norm((vecB[0], vecB[1]))*norm((vecA[0], vecA[1]))) and epsilon + dot(posA, (vecB[0], vecB[1]))/(norm(posA)*norm((vecB[0], vecB[1]))) >= dot((vecB[0], vecB[1]), (vecA[0], vecA[1]))/(norm((vecB[0], vecB[1]))*norm((vecA[0], vecA[1]))) and epsilon + dot(posB, (vecC[0], vecC[1]))/(norm(posB)*norm((vecC[0], vecC[1]))) >= dot((vecC[0], vecC[1]), (vecA.reversed()[0], vecA.reversed()[1]))/(norm((vecC[0], vecC[1]))*norm((vecA.reversed()[0], vecA.reversed()[1]))) and epsilon + dot(posB, (vecA.reversed()[0], vecA.reversed()[1]))/(norm(posB)*norm((vecA.reversed()[0], vecA.reversed()[1]))) >= dot((vecC[0], vecC[1]), (vecA.reversed()[0], vecA.reversed()[1]))/(norm((vecC[0], vecC[1]))*norm((vecA.reversed()[0], vecA.reversed()[1]))):
-          d.zs[pixelX][pixelY] = (-normVec[0]/normVec[2])*(pos[0]-vert1.pos[0]) + (-normVec[1]/normVec[2])*(pos[1]-vert1.pos[1]) + vert1.V
-
-  # 描画領域外をマスク
+  d.zs = newSeqWith(resolution[0], newSeq[float](resolution[1]))
   for pixelX in 0..<resolution[0]:
-    for pixelY in 0..<resolution[1]-1:
-      if xs[pixelX]^2 + ys[pixelY]^2 >= drawingArea[0][0]^2:
-        d.zs[pixelX][pixelY] = Inf
+    for pixelY in 0..<resolution[1]:
+      d.zs[pixelX][pixelY] = values[pixelX*resolution[1] + pixelY]
 
   d.marker = Marker[float](size: size, color: colors)
   var p = Plot[float](layout: layout)
   p = p.addTrace(d)
   #p.show(filename = "helloworld.png")
-  p.saveImage("DeltaV.svg")
+  p.saveImage(fileName)
   # NOTE: if we compile this without --threads:on support, we'll get
   # an error at compile time that thread support is needed.
 
-proc draw_Δσ*(mesh: Mesh, resolution: (int, int), drawingArea: ((float, float), (float, float)), title = "Δσ(actual conductivities change)") = 
-  ## 1. 3つの頂点から1組のベクトルを作って外積計算、法線ベクトルを算出し電位方程式を導出
-  ## 2. 対象のエレメント中にheatmapの描画対象のある点(x, y)が含まれるかを判定
-    ## AABBで捜索範囲を制限
-    ## 制限された範囲の中の各ピクセル座標について、エレメントの頂点から任意の2組のベクトルを選択
-    ## 選択されたベクトルとピクセル座標から内積を通じて角度を導出し、領域内にあるかどうかを確認
-  ## 3. 描画対象に含まれる場合、座標を電位方程式に代入して電位を算出し格納
-  
+proc draw_V*(mesh: Mesh, resolution: (int, int), drawingArea: ((float, float), (float, float)), backend = defaultPlotBackend) =
+  ## 1. (メッシュ, 解像度, 描画領域)に対するラスタマップ(各ピクセルを含むエレメントと面積座標)を取得(作成済みであれば再利用)
+  ## 2. 各ピクセルの電位を、エレメントの3頂点の電位を面積座標で線形補間して求める(3頂点を通る平面の式と同じ)
   let
-    layout = Layout(title: title, width: 600, height: 600,
-                      xaxis: Axis(title: "x"),
-                      yaxis: Axis(title: "y"), 
-                      autosize:false)
-    # 計算精度の都合上と思われる電位計算時の導出ヌケを防ぐために意図的に小さな値を加算
-    epsilon = 1e-8
-  
-  var
-    xs = newSeq[float](resolution[0])
-    ys = newSeq[float](resolution[1])
-    colors: seq[Color]
-    d = Trace[float](mode: PlotMode.Lines, `type`: PlotType.HeatMap)
-    size = @[16.float]
-  
-  d.zs = newSeqWith(resolution[0], newSeq[float](resolution[1]))
-  
-  # ヒートマップのマス目の座標の定義(左下を基準としている)
-  for i in 0..<resolution[0]:
-    xs[i] = drawingArea[0][0] + i.toFloat*(drawingArea[1][0] - drawingArea[0][0])/resolution[0].toFloat
-  for i in 0..<resolution[1]:
-    ys[i] = drawingArea[0][1] + i.toFloat*(drawingArea[1][1] - drawingArea[0][1])/resolution[1].toFloat
-  
-  # 電位方程式の計算
-  for elem in mesh.elements.items():
-    let
-      vert1 = mesh.vertices[elem.idxVertice1]
-      vert2 = mesh.vertices[elem.idxVertice2]
-      vert3 = mesh.vertices[elem.idxVertice3]
-    
-    # 外積計算をするベクトルの決定
-    var
-      vecA: (float, float, float)
-      vecB: (float, float, float)
-      vecC: (float, float, float)
-      vecA_start: Vertice2D
-      vecA_end: Vertice2D
-
-    # 最もx座標が大きいノードを外積計算の2ベクトルの始点に指定
-    if vert1.pos[0] > vert2.pos[0]:
-      if vert1.pos[0] > vert3.pos[0]:
-        vecA = (vert2.pos[0] - vert1.pos[0], vert2.pos[1] - vert1.pos[1], vert2.V - vert1.V)
-        vecB = (vert3.pos[0] - vert1.pos[0], vert3.pos[1] - vert1.pos[1], vert3.V - vert1.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert1
-        vecA_end = vert2
-      else:
-        vecA = (vert1.pos[0] - vert3.pos[0], vert1.pos[1] - vert3.pos[1], vert1.V - vert3.V)
-        vecB = (vert2.pos[0] - vert3.pos[0], vert2.pos[1] - vert3.pos[1], vert2.V - vert3.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert3
-        vecA_end = vert1
-    else:
-      if vert2.pos[0] > vert3.pos[0]:
-        vecA = (vert3.pos[0] - vert2.pos[0], vert3.pos[1] - vert2.pos[1], vert3.V - vert2.V)
-        vecB = (vert1.pos[0] - vert2.pos[0], vert1.pos[1] - vert2.pos[1], vert1.V - vert2.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert2
-        vecA_end = vert3
-      else:
-        vecA = (vert1.pos[0] - vert3.pos[0], vert1.pos[1] - vert3.pos[1], vert1.V - vert3.V)
-        vecB = (vert2.pos[0] - vert3.pos[0], vert2.pos[1] - vert3.pos[1], vert2.V - vert3.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert3
-        vecA_end = vert1
-    
-    # 捜索範囲としてのAABB(Axis-Aligned Bounding Box)の定義
-    let
-      AABB0 = (min(min(vert1.pos[0], vert2.pos[0]), vert3.pos[0]), min(min(vert1.pos[1], vert2.pos[1]), vert3.pos[1]))
-      AABB1 = (max(max(vert1.pos[0], vert2.pos[0]), vert3.pos[0]), max(max(vert1.pos[1], vert2.pos[1]), vert3.pos[1]))
-    
-    # AABBのピクセル値取得
-    let
-      AABB0pixelX = int(resolution[0].toFloat*(AABB0[0] - drawingArea[0][0])/(drawingArea[1][0] - drawingArea[0][0]))
-      AABB0pixelY = int(resolution[1].toFloat*(AABB0[1] - drawingArea[0][1])/(drawingArea[1][1] - drawingArea[0][1]))
-      AABB1pixelX = int(resolution[0].toFloat*(AABB1[0] - drawingArea[0][0])/(drawingArea[1][0] - drawingArea[0][0]))
-      AABB1pixelY = int(resolution[1].toFloat*(AABB1[1] - drawingArea[0][1])/(drawingArea[1][1] - drawingArea[0][1]))
-      
-    # 電位描画
-
-    for pixelX in AABB0pixelX..min(AABB1pixelX, resolution[0]-1):
-      for pixelY in AABB0pixelY..min(AABB1pixelY, resolution[1]-1):
-        # 内積の大小から角度の大小関係を確認、エレメント内に対象の座標が居るかを確認
-        var
-          posA: (float, float)
-          posB: (float, float)
-
-        if vecA_start == vert1:
-          posA = (xs[pixelX] - vert1.pos[0], ys[pixelY] - vert1.pos[1])
-        if vecA_start == vert2:
-          posA = (xs[pixelX] - vert2.pos[0], ys[pixelY] - vert2.pos[1])
-        if vecA_start == vert3:
-          posA = (xs[pixelX] - vert3.pos[0], ys[pixelY] - vert3.pos[1])
-        
-        if vecA_end == vert1:
-          posB = (xs[pixelX] - vert1.pos[0], ys[pixelY] - vert1.pos[1])
-        if vecA_end == vert2:
-          posB = (xs[pixelX] - vert2.pos[0], ys[pixelY] - vert2.pos[1])
-        if vecA_end == vert3:
-          posB = (xs[pixelX] - vert3.pos[0], ys[pixelY] - vert3.pos[1])
-
-        if epsilon + dot(posA, (vecA[0], vecA[1]))/(norm(posA)*norm((vecA[0], vecA[1]))) >= dot((vecB[0], vecB[1]), (vecA[0], vecA[1]))/(norm((vecB[0], vecB[1]))*norm((vecA[0], vecA[1]))) and epsilon + dot(posA, (vecB[0], vecB[1]))/(norm(posA)*norm((vecB[0], vecB[1]))) >= dot((vecB[0], vecB[1]), (vecA[0], vecA[1]))/(norm((vecB[0], vecB[1]))*norm((vecA[0], vecA[1]))) and epsilon + dot(posB, (vecC[0], vecC[1]))/(norm(posB)*norm((vecC[0], vecC[1]))) >= dot((vecC[0], vecC[1]), (vecA.reversed()[0], vecA.reversed()[1]))/(norm((vecC[0], vecC[1]))*norm((vecA.reversed()[0], vecA.reversed()[1]))) and epsilon + dot(posB, (vecA.reversed()[0], vecA.reversed()[1]))/(norm(posB)*norm((vecA.reversed()[0], vecA.reversed()[1]))) >= dot((vecC[0], vecC[1]), (vecA.reversed()[0], vecA.reversed()[1]))/(norm((vecC[0], vecC[1]))*norm((vecA.reversed()[0], vecA.reversed()[1]))):
-          d.zs[pixelX][pixelY] = elem.Δσ
+    geometry = geometry_of(mesh)
+    map = raster_map_for(geometry, resolution, drawingArea)
+  draw_heatmap(map.gather_vertice_values(geometry, frame_of(mesh).V), resolution, "voltages", "DeltaV.svg", backend)
 
-  # 描画領域外をマスク
-  for pixelX in 0..<resolution[0]:
-    for pixelY in 0..<resolution[1]-1:
-      if xs[pixelX]^2 + ys[pixelY]^2 >= drawingArea[0][0]^2:
-        d.zs[pixelX][pixelY] = Inf
-
-  d.marker = Marker[float](size: size, color: colors)
-  var p = Plot[float](layout: layout)
-  p = p.addTrace(d)
-  #p.show(filename = "helloworld.png")
-  p.saveImage("DeltaSigma.svg")
-  # NOTE: if we compile this without --threads:on support, we'll get
-  # an error at compile time that thread support is needed.
-  
-proc draw_δσ*(mesh: Mesh, resolution: (int, int), drawingArea: ((float, float), (float, float)), title = "δσ(estimated conductivities change)") = 
-  ## 1. 3つの頂点から1組のベクトルを作って外積計算、法線ベクトルを算出し電位方程式を導出
-  ## 2. 対象のエレメント中にheatmapの描画対象のある点(x, y)が含まれるかを判定
-    ## AABBで捜索範囲を制限
-    ## 制限された範囲の中の各ピクセル座標について、エレメントの頂点から任意の2組のベクトルを選択
-    ## 選択されたベクトルとピクセル座標から内積を通じて角度を導出し、領域内にあるかどうかを確認
-  ## 3. 描画対象に含まれる場合、座標を電位方程式に代入して電位を算出し格納
-  
+proc draw_Δσ*(mesh: Mesh, resolution: (int, int), drawingArea: ((float, float), (float, float)), title = "Δσ(actual conductivities change)", backend = defaultPlotBackend) = 
+  ## 各ピクセルに、そのピクセルを含むエレメントのΔσを割り当てる(ラスタマップは draw_V と共有)
   let
-    layout = Layout(title: title, width: 600, height: 600,
-                      xaxis: Axis(title: "x"),
-                      yaxis: Axis(title: "y"), 
-                      autosize:false)
-    # 計算精度の都合上と思われる電位計算時の導出ヌケを防ぐために意図的に小さな値を加算
-    epsilon = 1e-8
+    geometry = geometry_of(mesh)
+    map = raster_map_for(geometry, resolution, drawingArea)
+  draw_heatmap(map.gather_element_values(frame_of(mesh).Δσ), resolution, title, "DeltaSigma.svg", backend)
   
-  var
-    xs = newSeq[float](resolution[0])
-    ys = newSeq[float](resolution[1])
-    colors: seq[Color]
-    d = Trace[float](mode: PlotMode.Lines, `type`: PlotType.HeatMap)
-    size = @[16.float]
-  
-  d.zs = newSeqWith(resolution[0], newSeq[float](resolution[1]))
-  
-  # ヒートマップのマス目の座標の定義(左下を基準としている)
-  for i in 0..<resolution[0]:
-    xs[i] = drawingArea[0][0] + i.toFloat*(drawingArea[1][0] - drawingArea[0][0])/resolution[0].toFloat
-  for i in 0..<resolution[1]:
-    ys[i] = drawingArea[0][1] + i.toFloat*(drawingArea[1][1] - drawingArea[0][1])/resolution[1].toFloat
-  
-  # 電位方程式の計算
-  for elem in mesh.elements.items():
-    let
-      vert1 = mesh.vertices[elem.idxVertice1]
-      vert2 = mesh.vertices[elem.idxVertice2]
-      vert3 = mesh.vertices[elem.idxVertice3]
-    
-    # 外積計算をするベクトルの決定
-    var
-      vecA: (float, float, float)
-      vecB: (float, float, float)
-      vecC: (float, float, float)
-      vecA_start: Vertice2D
-      vecA_end: Vertice2D
-
-    # 最もx座標が大きいノードを外積計算の2ベクトルの始点に指定
-    if vert1.pos[0] > vert2.pos[0]:
-      if vert1.pos[0] > vert3.pos[0]:
-        vecA = (vert2.pos[0] - vert1.pos[0], vert2.pos[1] - vert1.pos[1], vert2.V - vert1.V)
-        vecB = (vert3.pos[0] - vert1.pos[0], vert3.pos[1] - vert1.pos[1], vert3.V - vert1.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert1
-        vecA_end = vert2
-      else:
-        vecA = (vert1.pos[0] - vert3.pos[0], vert1.pos[1] - vert3.pos[1], vert1.V - vert3.V)
-        vecB = (vert2.pos[0] - vert3.pos[0], vert2.pos[1] - vert3.pos[1], vert2.V - vert3.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert3
-        vecA_end = vert1
-    else:
-      if vert2.pos[0] > vert3.pos[0]:
-        vecA = (vert3.pos[0] - vert2.pos[0], vert3.pos[1] - vert2.pos[1], vert3.V - vert2.V)
-        vecB = (vert1.pos[0] - vert2.pos[0], vert1.pos[1] - vert2.pos[1], vert1.V - vert2.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert2
-        vecA_end = vert3
-      else:
-        vecA = (vert1.pos[0] - vert3.pos[0], vert1.pos[1] - vert3.pos[1], vert1.V - vert3.V)
-        vecB = (vert2.pos[0] - vert3.pos[0], vert2.pos[1] - vert3.pos[1], vert2.V - vert3.V)
-        vecC = (vecB[0] - vecA[0], vecB[1] - vecA[1], vecB[2] - vecA[2])
-        vecA_start = vert3
-        vecA_end = vert1
-    
-    # 法線ベクトル(一次近似の電位方程式の係数ベクトル)算出(向きは考慮しない)
-
-    # 捜索範囲としてのAABB(Axis-Aligned Bounding Box)の定義
-    let
-      AABB0 = (min(min(vert1.pos[0], vert2.pos[0]), vert3.pos[0]), min(min(vert1.pos[1], vert2.pos[1]), vert3.pos[1]))
-      AABB1 = (max(max(vert1.pos[0], vert2.pos[0]), vert3.pos[0]), max(max(vert1.pos[1], vert2.pos[1]), vert3.pos[1]))
-    
-    # AABBのピクセル値取得
-    let
-      AABB0pixelX = int(resolution[0].toFloat*(AABB0[0] - drawingArea[0][0])/(drawingArea[1][0] - drawingArea[0][0]))
-      AABB0pixelY = int(resolution[1].toFloat*(AABB0[1] - drawingArea[0][1])/(drawingArea[1][1] - drawingArea[0][1]))
-      AABB1pixelX = int(resolution[0].toFloat*(AABB1[0] - drawingArea[0][0])/(drawingArea[1][0] - drawingArea[0][0]))
-      AABB1pixelY = int(resolution[1].toFloat*(AABB1[1] - drawingArea[0][1])/(drawingArea[1][1] - drawingArea[0][1]))
-      
-    # 電位描画
-
-    for pixelX in AABB0pixelX..min(AABB1pixelX, resolution[0]-1):
-      for pixelY in AABB0pixelY..min(AABB1pixelY, resolution[1]-1):
-        # 内積の大小から角度の大小関係を確認、エレメント内に対象の座標が居るかを確認
-        var
-          posA: (float, float)
-          posB: (float, float)
-
-        if vecA_start == vert1:
-          posA = (xs[pixelX] - vert1.pos[0], ys[pixelY] - vert1.pos[1])
-        if vecA_start == vert2:
-          posA = (xs[pixelX] - vert2.pos[0], ys[pixelY] - vert2.pos[1])
-        if vecA_start == vert3:
-          posA = (xs[pixelX] - vert3.pos[0], ys[pixelY] - vert3.pos[1])
-        
-        if vecA_end == vert1:
-          posB = (xs[pixelX] - vert1.pos[0], ys[pixelY] - vert1.pos[1])
-        if vecA_end == vert2:
-          posB = (xs[pixelX] - vert2.pos[0], ys[pixelY] - vert2.pos[1])
-        if vecA_end == vert3:
-          posB = (xs[pixelX] - vert3.pos[0], ys[pixelY] - vert3.pos[1])
-
-        if epsilon + dot(posA, (vecA[0], vecA[1]))/(norm(posA)*norm((vecA[0], vecA[1]))) >= dot((vecB[0], vecB[1]), (vecA[0], vecA[1]))/(norm((vecB[0], vecB[1]))*norm((vecA[0], vecA[1]))) and epsilon + dot(posA, (vecB[0], vecB[1]))/(norm(posA)*norm((vecB[0], vecB[1]))) >= dot((vecB[0], vecB[1]), (vecA[0], vecA[1]))/(norm((vecB[0], vecB[1]))*norm((vecA[0], vecA[1]))) and epsilon + dot(posB, (vecC[0], vecC[1]))/(norm(posB)*norm((vecC[0], vecC[1]))) >= dot((vecC[0], vecC[1]), (vecA.reversed()[0], vecA.reversed()[1]))/(norm((vecC[0], vecC[1]))*norm((vecA.reversed()[0], vecA.reversed()[1]))) and epsilon + dot(posB, (vecA.reversed()[0], vecA.reversed()[1]))/(norm(posB)*norm((vecA.reversed()[0], vecA.reversed()[1]))) >= dot((vecC[0], vecC[1]), (vecA.reversed()[0], vecA.reversed()[1]))/(norm((vecC[0], vecC[1]))*norm((vecA.reversed()[0], vecA.reversed()[1]))):
-          d.zs[pixelX][pixelY] = elem.δσ
+proc draw_δσ*(mesh: Mesh, resolution: (int, int), drawingArea: ((float, float), (float, float)), title = "δσ(estimated conductivities change)", backend = defaultPlotBackend) = 
+  ## 各ピクセルに、そのピクセルを含むエレメントのδσを割り当てる(ラスタマップは draw_V と共有)
+  let
+    geometry = geometry_of(mesh)
+    map = raster_map_for(geometry, resolution, drawingArea)
+  draw_heatmap(map.gather_element_values(frame_of(mesh).δσ), resolution, title, "DelSigma.svg", backend)
 
-  # 描画領域外をマスク
-  for pixelX in 0..<resolution[0]:
-    for pixelY in 0..<resolution[1]-1:
-      if xs[pixelX]^2 + ys[pixelY]^2 >= drawingArea[0][0]^2:
-        d.zs[pixelX][pixelY] = Inf
+const heatmapFramesPerBatch = 8
+  ## 多数のフレームを描画する際に、一度に画像(float32)を持つフレーム数
 
-  d.marker = Marker[float](size: size, color: colors)
-  var p = Plot[float](layout: layout)
-  p = p.addTrace(d)
-  #p.show(filename = "helloworld.png")
-  p.saveImage("DelSigma.svg")
-  # NOTE: if we compile this without --threads:on support, we'll get
-  # an error at compile time that thread support is needed.
\ No newline at end of file
+proc draw_frames(geometry: MeshGeometry, values: Tensor[float], onVertices: bool, resolution: (int, int), drawingArea: ((float, float), (float, float)), pathPrefix: string, firstFrame: int) =
+  ## フレーム毎の値(フレーム数*頂点数 または フレーム数*エレメント数)を pathPrefix & "_<フレーム番号>.png" に保存
+  ## 色は全フレームで共通にするため、値の範囲は全フレームの値と背景(エレメント外の0)から一度だけ決める
+  ## 画像のバッファは heatmapFramesPerBatch フレーム分のみ確保し、使い回す
+  let
+    numFrames = values.shape[0]
+    numPixels = resolution[0]*resolution[1]
+    map = raster_map_for(geometry, resolution, drawingArea)
+    contiguousValues = if values.is_C_contiguous: values else: values.clone()
+  if numFrames == 0 or values.size == 0:
+    return
+  var valueRange = finite_range(toOpenArray(cast[ptr UncheckedArray[float]](contiguousValues.get_offset_ptr), 0, values.size - 1))
+  valueRange = (min(valueRange[0], 0.0), max(valueRange[1], 0.0))
+
+  var images = newTensorUninit[float32](min(heatmapFramesPerBatch, numFrames), numPixels)
+  for first in countup(0, numFrames - 1, heatmapFramesPerBatch):
+    let count = min(heatmapFramesPerBatch, numFrames - first)
+    if images.shape[0] != count:
+      images = newTensorUninit[float32](count, numPixels)
+    let batch = contiguousValues[first..<first + count, _]
+    let gathered = if onVertices: map.gather_vertice_values_batch(geometry, batch, images) else: map.gather_element_values_batch(batch, images)
+    if gathered.isErr:
+      echo "Failed to draw frames: " & gathered.error.msg
+      return
+    let written = write_heatmap_pngs(pathPrefix, images, resolution, valueRange, firstFrame + first)
+    if written.isErr:
+      echo "Failed to draw frames: " & written.error.msg
+      return
+
+proc draw_V_frames*(geometry: MeshGeometry, Vs: Tensor[float], resolution: (int, int), drawingArea: ((float, float), (float, float)), firstFrame = 0) =
+  ## フレーム数*頂点数の電位を、フレーム毎に DeltaV_<フレーム番号>.png に保存する(フレームは数が多いため、常にPNG)
+  draw_frames(geometry, Vs, onVertices = true, resolution, drawingArea, "DeltaV", firstFrame)
+
+proc draw_δσ_frames*(geometry: MeshGeometry, δσs: Tensor[float], resolution: (int, int), drawingArea: ((float, float), (float, float)), firstFrame = 0) =
+  ## フレーム数*エレメント数のδσを、フレーム毎に DelSigma_<フレーム番号>.png に保存する(フレームは数が多いため、常にPNG)
+  draw_frames(geometry, δσs, onVertices = false, resolution, drawingArea, "DelSigma", firstFrame)
@@ -0,0 +1,244 @@
+## ヒートマップ描画用のラスタマップ(ピクセル -> エレメントの対応表)
+## 1. (メッシュ形状, 解像度, 描画領域) 毎に、各ピクセルを含むエレメントとその面積座標(3頂点の重み)を一度だけ求める
+## 2. 描画時は値の配列から各ピクセルの値を集める(gather)だけで済み、幾何計算は行わない
+##    頂点の値(V等)は面積座標で線形補間、エレメントの値(Δσ、δσ等)はそのまま
+## 3. ピクセル(pixelX, pixelY)は平坦な配列の pixelX*解像度Y + pixelY 番目(従来の zs[pixelX][pixelY] と同じ並び)
+##    ピクセルの座標は左下の角
+## 4. gatherは画像をタイルに分割してOpenMPで並列に処理し(-d:openmp を付けた場合のみ、無ければ逐次)、多数のフレームを呼び出し側のバッファ(float32)に一定数ずつ描画できる
+
+import std/[tables, math, sequtils]
+import arraymancer, arraymancer/laser/openmp, results
+import mesh, geometry, cache
+
+type
+  RasterMap* = object
+    resolution*: (int, int)
+    drawingArea*: ((float, float), (float, float))
+    element*: seq[int32]
+      ## ピクセルを含むエレメント(どのエレメントにも含まれなければ-1)
+    weights*: seq[array[3, float32]]
+      ## エレメントの3頂点(tri の順)に対する面積座標
+    masked*: seq[bool]
+      ## 描画領域外(原点からの距離が描画領域の半径以上)のピクセル
+
+const
+  subpixelBits = 8
+    ## 頂点座標の固定小数点化の精度(1ピクセルを 2^subpixelBits 分割)
+  tileSize = 64
+    ## 並列描画の単位(tileSize*tileSize ピクセル)
+
+var rasterMapCache: Table[string, RasterMap]
+  ## 描画関数は毎回Meshを受け取るため、形状のハッシュ・解像度・描画領域をキーとしてメモリ上に保持する
+
+func pixel_x*(map: RasterMap, i: int): float =
+  let area = map.drawingArea
+  return area[0][0] + i.float*(area[1][0] - area[0][0])/map.resolution[0].float
+
+func pixel_y*(map: RasterMap, j: int): float =
+  let area = map.drawingArea
+  return area[0][1] + j.float*(area[1][1] - area[0][1])/map.resolution[1].float
+
+proc build_raster_map*(geometry: MeshGeometry, resolution: (int, int), drawingArea: ((float, float), (float, float))): RasterMap =
+  ## エレメント毎に固定小数点の辺関数で走査し、各ピクセルを含むエレメントと面積座標を求める
+  ## 1. 頂点座標をピクセル単位(1/2^subpixelBits の固定小数点)の整数に丸める
+  ##    共有する頂点は同じ整数になるため、隣り合うエレメントの辺は完全に一致する
+  ## 2. 3辺の辺関数がいずれも非負のピクセルを塗る、辺関数が0のピクセルはトップレフトルールで一方のエレメントのみに割り当てる
+  ##    (反時計回りで y が下向きの辺(左辺)と、水平で x が負向きの辺(上辺)が所有する)
+  ## 3. 辺関数は pixelY 方向(平坦な配列で連続な方向)に1ピクセル進む毎に定数を足すだけで更新し、面積座標は辺関数/面積の2倍で求める
+  let numPixels = resolution[0]*resolution[1]
+  var map = RasterMap(resolution: resolution, drawingArea: drawingArea)
+  map.element = newSeq[int32](numPixels)
+  map.weights = newSeq[array[3, float32]](numPixels)
+  map.masked = newSeq[bool](numPixels)
+  for pixel in 0..<numPixels:
+    map.element[pixel] = -1
+
+  let
+    scale = (1 shl subpixelBits).int64
+    pixelSizeX = (drawingArea[1][0] - drawingArea[0][0])/resolution[0].float
+    pixelSizeY = (drawingArea[1][1] - drawingArea[0][1])/resolution[1].float
+
+  for e in 0..<geometry.num_elements:
+    # 1. 固定小数点のピクセル座標、反時計回りでなければ頂点を入れ替える(order: 走査順 -> tri 内の位置)
+    var
+      order = [0, 1, 2]
+      px: array[3, int64]
+      py: array[3, int64]
+    for k in 0..<3:
+      let v = geometry.tri[3*e + k]
+      px[k] = int64(round((geometry.x[v] - drawingArea[0][0])/pixelSizeX*scale.float))
+      py[k] = int64(round((geometry.y[v] - drawingArea[0][1])/pixelSizeY*scale.float))
+    var area2 = (px[1] - px[0])*(py[2] - py[0]) - (py[1] - py[0])*(px[2] - px[0])
+    if area2 == 0:
+      continue
+    if area2 < 0:
+      swap(order[1], order[2])
+      swap(px[1], px[2])
+      swap(py[1], py[2])
+      area2 = -area2
+
+    # 2. 辺k(頂点kの対辺 k+1 -> k+2)の向きと所有判定
+    var
+      edgeX: array[3, int64]
+      edgeY: array[3, int64]
+      bias: array[3, int64]
+    for k in 0..<3:
+      let
+        a = (k+1) mod 3
+        b = (k+2) mod 3
+      edgeX[k] = px[b] - px[a]
+      edgeY[k] = py[b] - py[a]
+      bias[k] = if edgeY[k] < 0 or (edgeY[k] == 0 and edgeX[k] < 0): 0 else: 1
+
+    # 3. 外接矩形内のピクセル(サンプル点は整数座標*scale)を走査
+    let
+      minI = max(0, int(-floorDiv(-min(px[0], min(px[1], px[2])), scale)))
+      maxI = min(resolution[0] - 1, int(floorDiv(max(px[0], max(px[1], px[2])), scale)))
+      minJ = max(0, int(-floorDiv(-min(py[0], min(py[1], py[2])), scale)))
+      maxJ = min(resolution[1] - 1, int(floorDiv(max(py[0], max(py[1], py[2])), scale)))
+      invArea2 = 1.0/area2.float
+    for i in minI..maxI:
+      var w: array[3, int64]
+      for k in 0..<3:
+        let a = (k+1) mod 3
+        w[k] = edgeX[k]*(minJ.int64*scale - py[a]) - edgeY[k]*(i.int64*scale - px[a])
+      for j in minJ..maxJ:
+        if w[0] >= bias[0] and w[1] >= bias[1] and w[2] >= bias[2]:
+          let pixel = i*resolution[1] + j
+          map.element[pixel] = e.int32
+          for k in 0..<3:
+            map.weights[pixel][order[k]] = float32(w[k].float*invArea2)
+        for k in 0..<3:
+          w[k] += edgeX[k]*scale
+
+  for i in 0..<resolution[0]:
+    let x = map.pixel_x(i)
+    for j in 0..<resolution[1]:
+      let y = map.pixel_y(j)
+      map.masked[i*resolution[1] + j] = x*x + y*y >= drawingArea[0][0]*drawingArea[0][0]
+
+  return map
+
+proc raster_map_for*(geometry: MeshGeometry, resolution: (int, int), drawingArea: ((float, float), (float, float))): RasterMap =
+  ## 同じ形状・解像度・描画領域のラスタマップが作成済みであればそれを返す
+  var h = init_content_hash()
+  h.add(geometry)
+  h.add(resolution[0])
+  h.add(resolution[1])
+  h.add(drawingArea[0][0])
+  h.add(drawingArea[0][1])
+  h.add(drawingArea[1][0])
+  h.add(drawingArea[1][1])
+  let key = $h
+
+  if key notin rasterMapCache:
+    rasterMapCache[key] = build_raster_map(geometry, resolution, drawingArea)
+  return rasterMapCache[key]
+
+type
+  Tiles = object
+    numTilesX: int
+    numTilesY: int
+
+func tiles_of(map: RasterMap): Tiles =
+  return Tiles(numTilesX: (map.resolution[0] + tileSize - 1) div tileSize, numTilesY: (map.resolution[1] + tileSize - 1) div tileSize)
+
+template for_each_tile_pixel(map: RasterMap, tiles: Tiles, task: int, frame, pixel, body: untyped) =
+  ## task番目のタイル(フレーム毎に numTilesX*numTilesY 個)の各ピクセルについてbodyを実行
+  let
+    numTiles = tiles.numTilesX*tiles.numTilesY
+    frame = task div numTiles
+    tile = task mod numTiles
+    i0 = (tile div tiles.numTilesY)*tileSize
+    j0 = (tile mod tiles.numTilesY)*tileSize
+  for i in i0..<min(i0 + tileSize, map.resolution[0]):
+    for j in j0..<min(j0 + tileSize, map.resolution[1]):
+      let pixel = i*map.resolution[1] + j
+      body
+
+proc check_images(images: Tensor[float32], numFrames: int, numPixels: int): Result[void, CatchableError] =
+  if images.rank != 2 or images.shape[0] != numFrames or images.shape[1] != numPixels or not images.is_C_contiguous:
+    return CatchableError(msg: "images' shape must be [numFrames, numPixels] (C contiguous)").err()
+  return ok()
+
+proc gather_vertice_values_batch*(map: RasterMap, geometry: MeshGeometry, values: Tensor[float], images: var Tensor[float32]): Result[void, CatchableError] =
+  ## 頂点の値(フレーム数*頂点数)を面積座標で補間し、呼び出し側が用意したフレーム数*ピクセル数の画像に書き込む(描画領域外はInf、エレメント外は0)
+  ## 表示用なので画像はfloat32とし、多数のフレームは一定数ずつ同じバッファを使い回して処理する(全フレーム分の画像を一度に持たない)
+  ## (フレーム, タイル)の組をOpenMPのスレッドに分割する、各タイルは出力の互いに重ならない領域にのみ書き込むためロックは不要
+  let
+    numFrames = values.shape[0]
+    numVertices = values.shape[1]
+    numPixels = len(map.element)
+    tiles = map.tiles_of
+    contiguousValues = values.clone()
+  let checked = check_images(images, numFrames, numPixels)
+  if checked.isErr:
+    return checked
+  if numFrames == 0 or numPixels == 0:
+    return ok()
+
+  let
+    pValues = cast[ptr UncheckedArray[float]](contiguousValues.get_offset_ptr)
+    pImages = cast[ptr UncheckedArray[float32]](images.get_offset_ptr)
+    pElement = cast[ptr UncheckedArray[int32]](map.element[0].unsafeAddr)
+    pWeights = cast[ptr UncheckedArray[array[3, float32]]](map.weights[0].unsafeAddr)
+    pMasked = cast[ptr UncheckedArray[bool]](map.masked[0].unsafeAddr)
+    pTri = cast[ptr UncheckedArray[int32]](geometry.tri[0].unsafeAddr)
+
+  omp_parallel_for(task, numFrames*tiles.numTilesX*tiles.numTilesY, omp_grain_size = 1, use_simd = false):
+    for_each_tile_pixel(map, tiles, task, frame, pixel):
+      let e = pElement[pixel].int
+      if pMasked[pixel]:
+        pImages[frame*numPixels + pixel] = Inf.float32
+      elif e >= 0:
+        let w = pWeights[pixel]
+        pImages[frame*numPixels + pixel] = float32(w[0].float*pValues[frame*numVertices + pTri[3*e]] + w[1].float*pValues[frame*numVertices + pTri[3*e + 1]] + w[2].float*pValues[frame*numVertices + pTri[3*e + 2]])
+      else:
+        pImages[frame*numPixels + pixel] = 0.0
+
+  return ok()
+
+proc gather_element_values_batch*(map: RasterMap, values: Tensor[float], images: var Tensor[float32]): Result[void, CatchableError] =
+  ## エレメントの値(フレーム数*エレメント数)をそのままピクセルの値とし、呼び出し側が用意したフレーム数*ピクセル数の画像に書き込む
+  ## バッファの扱いと並列化は gather_vertice_values_batch と同じ
+  let
+    numFrames = values.shape[0]
+    numElements = values.shape[1]
+    numPixels = len(map.element)
+    tiles = map.tiles_of
+    contiguousValues = values.clone()
+  let checked = check_images(images, numFrames, numPixels)
+  if checked.isErr:
+    return checked
+  if numFrames == 0 or numPixels == 0:
+    return ok()
+
+  let
+    pValues = cast[ptr UncheckedArray[float]](contiguousValues.get_offset_ptr)
+    pImages = cast[ptr UncheckedArray[float32]](images.get_offset_ptr)
+    pElement = cast[ptr UncheckedArray[int32]](map.element[0].unsafeAddr)
+    pMasked = cast[ptr UncheckedArray[bool]](map.masked[0].unsafeAddr)
+
+  omp_parallel_for(task, numFrames*tiles.numTilesX*tiles.numTilesY, omp_grain_size = 1, use_simd = false):
+    for_each_tile_pixel(map, tiles, task, frame, pixel):
+      let e = pElement[pixel].int
+      if pMasked[pixel]:
+        pImages[frame*numPixels + pixel] = Inf.float32
+      elif e >= 0:
+        pImages[frame*numPixels + pixel] = pValues[frame*numElements + e].float32
+      else:
+        pImages[frame*numPixels + pixel] = 0.0
+
+  return ok()
+
+proc gather_vertice_values*(map: RasterMap, geometry: MeshGeometry, values: seq[float]): seq[float] =
+  ## 1フレーム分の gather_vertice_values_batch
+  var image = newTensorUninit[float32](1, len(map.element))
+  map.gather_vertice_values_batch(geometry, values.toTensor.reshape(1, len(values)), image).value
+  return image.toFlatSeq.mapIt(it.float)
+
+proc gather_element_values*(map: RasterMap, values: seq[float]): seq[float] =
+  ## 1フレーム分の gather_element_values_batch
+  var image = newTensorUninit[float32](1, len(map.element))
+  map.gather_element_values_batch(values.toTensor.reshape(1, len(values)), image).value
+  return image.toFlatSeq.mapIt(it.float)
@@ -0,0 +1,190 @@
+## キャッシュ局所性のための頂点・エレメントの並べ替え
+## 1. 頂点: 逆Cuthill-McKee(RCM)法で剛性行列のバンド幅を小さくする
+## 2. エレメント: 重心のHilbert曲線上の順序で並べ、空間的に近いエレメントをメモリ上でも近くに置く
+## 3. 電極(外周頂点)は先頭 0..<numOuterVertices に固定し、電極番号 = 頂点インデックス の対応を保つ
+##    (電位基準点や電流パターン、ヤコビアンの行は電極番号で参照しているため)
+
+import std/[algorithm, deques]
+import results
+import mesh, topology
+
+type
+  MeshPermutation* = object
+    ## いずれも 新インデックス -> 元のインデックス
+    ## 電極は先頭に固定されるため vertices[k] = k (k < numOuterVertices) であり、電極番号はそのまま頂点インデックスとして使える
+    vertices*: seq[int]
+    elements*: seq[int]
+
+const hilbertOrder = 16
+  ## Hilbert曲線の格子は 2^hilbertOrder * 2^hilbertOrder
+
+func hilbert_index(n: int, x: int, y: int): int =
+  ## n*n格子上の点(x, y)のHilbert曲線上の位置
+  var
+    x = x
+    y = y
+    s = n div 2
+  while s > 0:
+    let
+      rx = if (x and s) > 0: 1 else: 0
+      ry = if (y and s) > 0: 1 else: 0
+    result += s*s*((3*rx) xor ry)
+    # 象限に合わせて回転
+    if ry == 0:
+      if rx == 1:
+        x = n - 1 - x
+        y = n - 1 - y
+      swap(x, y)
+    s = s div 2
+
+proc rcm_ordering*(adjacency: seq[seq[int]], numFixed: int): seq[int] =
+  ## 先頭numFixed個の頂点は固定し、残りの頂点(それらの間の隣接関係のみを考慮)をRCM法で並べる
+  ## 返り値は 新インデックス -> 元のインデックス
+  let numVertices = len(adjacency)
+  var
+    degree = newSeq[int](numVertices)
+    visited = newSeq[bool](numVertices)
+    order: seq[int]
+  for v in numFixed..<numVertices:
+    for u in adjacency[v]:
+      if u != v and u >= numFixed:
+        degree[v] += 1
+
+  proc bfs_levels(start: int): (int, int) =
+    ## 未訪問の頂点上で幅優先探索し、(最も遠い頂点のうち次数最小のもの, 深さ)を返す
+    var
+      level = newSeq[int](numVertices)
+      queue = initDeque[int]()
+      farthest = start
+    for v in 0..<numVertices:
+      level[v] = -1
+    level[start] = 0
+    queue.addLast(start)
+    while len(queue) > 0:
+      let v = queue.popFirst()
+      if level[v] > level[farthest] or (level[v] == level[farthest] and degree[v] < degree[farthest]):
+        farthest = v
+      for u in adjacency[v]:
+        if u >= numFixed and not visited[u] and level[u] < 0:
+          level[u] = level[v] + 1
+          queue.addLast(u)
+    return (farthest, level[farthest])
+
+  for v in 0..<numFixed:
+    visited[v] = true
+
+  while true:
+    # 1. 未訪問の頂点のうち次数最小のものから、擬似周辺頂点(最も離心率の大きい頂点の近似)を探す
+    var start = -1
+    for v in numFixed..<numVertices:
+      if not visited[v] and (start < 0 or degree[v] < degree[start]):
+        start = v
+    if start < 0:
+      break
+    var (candidate, depth) = bfs_levels(start)
+    while true:
+      let (next, nextDepth) = bfs_levels(candidate)
+      if nextDepth <= depth:
+        break
+      (candidate, depth) = (next, nextDepth)
+    start = candidate
+
+    # 2. Cuthill-McKee: 幅優先探索で、隣接頂点を次数の昇順に追加
+    var
+      component: seq[int]
+      queue = initDeque[int]()
+    visited[start] = true
+    queue.addLast(start)
+    while len(queue) > 0:
+      let v = queue.popFirst()
+      component.add(v)
+      var next: seq[int]
+      for u in adjacency[v]:
+        if u >= numFixed and not visited[u]:
+          visited[u] = true
+          next.add(u)
+      next.sort(proc (a, b: int): int = cmp(degree[a], degree[b]))
+      for u in next:
+        queue.addLast(u)
+
+    # 3. 逆順にする
+    component.reverse()
+    order.add(component)
+
+  result = newSeq[int](numFixed)
+  for v in 0..<numFixed:
+    result[v] = v
+  result.add(order)
+
+proc hilbert_element_ordering*(mesh: Mesh): seq[int] =
+  ## エレメントを重心のHilbert曲線上の位置の順に並べる
+  ## 返り値は 新インデックス -> 元のインデックス
+  if len(mesh.elements) == 0:
+    return @[]
+
+  var
+    minX = Inf
+    minY = Inf
+    maxX = -Inf
+    maxY = -Inf
+    centroids = newSeq[(float, float)](len(mesh.elements))
+  for (e, elem) in mesh.elements.pairs():
+    let
+      p1 = mesh.vertices[elem.idxVertice1].pos
+      p2 = mesh.vertices[elem.idxVertice2].pos
+      p3 = mesh.vertices[elem.idxVertice3].pos
+    centroids[e] = ((p1[0] + p2[0] + p3[0])/3, (p1[1] + p2[1] + p3[1])/3)
+    minX = min(minX, centroids[e][0])
+    minY = min(minY, centroids[e][1])
+    maxX = max(maxX, centroids[e][0])
+    maxY = max(maxY, centroids[e][1])
+
+  let
+    n = 1 shl hilbertOrder
+    scale = (n - 1).float/max(max(maxX - minX, maxY - minY), 1e-300)
+  var keys = newSeq[(int, int)](len(mesh.elements))
+  for (e, c) in centroids.pairs():
+    keys[e] = (hilbert_index(n, int((c[0] - minX)*scale), int((c[1] - minY)*scale)), e)
+  keys.sort()
+
+  result = newSeq[int](len(mesh.elements))
+  for (i, key) in keys.pairs():
+    result[i] = key[1]
+
+proc apply_permutation*(mesh: var Mesh, permutation: MeshPermutation) =
+  ## 頂点とエレメントを並べ替え、エレメントの頂点インデックスを新しいインデックスに付け替える
+  var newIndex = newSeq[int](len(mesh.vertices))
+  for (i, old) in permutation.vertices.pairs():
+    newIndex[old] = i
+
+  var
+    vertices = newSeq[Vertice2D](len(mesh.vertices))
+    elements = newSeq[Element](len(mesh.elements))
+  for (i, old) in permutation.vertices.pairs():
+    vertices[i] = mesh.vertices[old]
+  for (i, old) in permutation.elements.pairs():
+    elements[i] = mesh.elements[old]
+    elements[i].idxVertice1 = newIndex[elements[i].idxVertice1]
+    elements[i].idxVertice2 = newIndex[elements[i].idxVertice2]
+    elements[i].idxVertice3 = newIndex[elements[i].idxVertice3]
+
+  mesh.vertices = vertices
+  mesh.elements = elements
+
+proc renumber_mesh*(mesh: var Mesh): Result[MeshPermutation, CatchableError] =
+  ## 頂点をRCM順(電極は先頭に固定)、エレメントをHilbert順に並べ替える
+  let topology = build_topology(mesh)
+  if topology.isErr:
+    return topology.error.err()
+
+  # 先頭に固定する電極が外周頂点と一致していなければ、電極番号 = 頂点インデックス の対応が崩れる
+  for v in 0..<len(mesh.vertices):
+    if topology.value.is_boundary_vertice(mesh, v) != (v < mesh.numOuterVertices):
+      return CatchableError(msg: "vertice " & $v & " is " & (if v < mesh.numOuterVertices: "an electrode but not" else: "not an electrode but") & " on the boundary").err()
+
+  var permutation: MeshPermutation
+  permutation.vertices = rcm_ordering(topology.value.vertice_adjacency, mesh.numOuterVertices)
+  permutation.elements = hilbert_element_ordering(mesh)
+  mesh.apply_permutation(permutation)
+
+  return permutation.ok()
@@ -1,6 +1,6 @@
 import std/[sequtils, math]
 import arraymancer, results
-import plotter, mesh, forward
+import plotter, mesh, geometry, forward, sparse, cache, delaunay, renumber
 
 type
   MeshParams* = object
@@ -14,7 +14,9 @@ proc generate_mesh*(system: MeshParams, drawVert = false, drawMesh = false): Mes
   ## output: Mesh
   
   # Initial-1. Generate circle mesh with outer and center vertices
-  var mesh2d = generate_mesh_circle(system.numElectrodes, system.diameter).value
+  var
+    mesh2d = generate_mesh_circle(system.numElectrodes, system.diameter).value
+    triangulation = init_delaunay(mesh2d).value
 
   # Initial-2. Fill the circle mesh with added inner vertices
   for i in 0..<(system.numsInnerVertices.foldl(a+b)):
@@ -30,10 +32,14 @@ proc generate_mesh*(system: MeshParams, drawVert = false, drawMesh = false): Mes
 
     var newVert = Vertice2D(pos: newVertPos, V: 0.0)
 
-    delauney_method_mesh_update(mesh2d, newVert)
+    triangulation.insert_vertice(mesh2d, newVert).value
 
+  triangulation.write_elements(mesh2d)
   calculate_elements_area(mesh2d)
 
+  # Initial-3. Renumber vertices (RCM, electrodes are kept at the head) and elements (Hilbert order) for cache locality
+  discard renumber_mesh(mesh2d).value
+
   echo "Number of vertices: " & $len(mesh2d.vertices)
   echo "Number of elements: " & $len(mesh2d.elements)
   if drawVert:
@@ -43,23 +49,80 @@ proc generate_mesh*(system: MeshParams, drawVert = false, drawMesh = false): Mes
 
   return mesh2d
 
-proc get_stiffness_matrices*(mesh2d: Mesh): (Tensor[float], Tensor[float], Tensor[float]) =
+const meshCacheVersion = 3
+  ## メッシュ生成アルゴリズムを変えた場合はこれを上げて、保存済みのメッシュを無効化する
+
+proc mesh_params_hash*(system: MeshParams): uint64 =
+  var h = init_content_hash()
+  h.add(meshCacheVersion)
+  h.add(system.numElectrodes)
+  h.add(system.diameter)
+  h.add(len(system.numsInnerVertices))
+  for num in system.numsInnerVertices:
+    h.add(num)
+  h.add(system.diameters)
+  return h.value
+
+proc load_or_generate_mesh*(meshName: string, system: MeshParams, drawVert = false, drawMesh = false): Mesh =
+  ## mesh.tomlと同じフォルダのmesh.binに生成済みのメッシュがあり、パラメータのハッシュが一致すればそれを使う
+  ## 無ければ generate_mesh で生成して保存する
+  let
+    meshBinPath = "data/" & meshName & "/mesh.bin"
+    paramsHash = mesh_params_hash(system)
+    cached = load_mesh(meshBinPath, paramsHash)
+
+  if cached.isErr:
+    let mesh2d = generate_mesh(system, drawVert, drawMesh)
+    let saved = save_mesh(meshBinPath, mesh2d, paramsHash)
+    if saved.isErr:
+      echo "Failed to save the mesh cache: " & saved.error.msg
+    return mesh2d
+
+  let mesh2d = cached.value
+  echo "Mesh is loaded from " & meshBinPath
+  echo "Number of vertices: " & $len(mesh2d.vertices)
+  echo "Number of elements: " & $len(mesh2d.elements)
+  if drawVert:
+    draw_vertices(mesh2d)
+  if drawMesh:
+    draw_mesh(mesh2d)
+
+  return mesh2d
+
+proc get_local_stiffness_matrices(mesh2d: Mesh): (Tensor[float], Tensor[float]) =
   ## input: Mesh
-  ## output: (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat, stiffness_mat)
+  ## output: (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat)
 
   # Initial-3. Calc local stiffness matrix
   let
-    stackedLocalStiffnessMat = stack_stiffness_mat_local_tri(mesh2d).value
-  var  
-    unitStackedLocalStiffnessMat = zeros_like(stackedLocalStiffnessMat)
+    stackedLocalStiffnessMat = stack_stiffness_mat_local_tri(geometry_of(mesh2d)).value
+    frame = frame_of(mesh2d)
 
   # Initial-4. Multiply σRef(conductivity) to non-unit local stiffness matrix for each element
+  let unitStackedLocalStiffnessMat = scale_local_stiffness(stackedLocalStiffnessMat, frame.σRef).value # ここで伝導率の初期推定値への依存が発生
+
+  return (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat)
+
+proc get_stiffness_matrices*(mesh2d: Mesh): (Tensor[float], Tensor[float], Tensor[float]) =
+  ## input: Mesh
+  ## output: (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat, stiffness_mat)
 
-  for (i, elem) in mesh2d.elements.pairs:
-    unitStackedLocalStiffnessMat[i, _] = stackedLocalStiffnessMat[i, _]*elem.σRef # ここで伝導率の初期推定値への依存が発生
+  let (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat) = get_local_stiffness_matrices(mesh2d)
 
   # Initial-5. Map local stiffness matrix with conductivity to global large dense stiffness matrix
 
   let stiffness_mat = create_stiffness_mat(mesh2d, unitStackedLocalStiffnessMat).value
 
-  return (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat, stiffness_mat)
\ No newline at end of file
+  return (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat, stiffness_mat)
+
+proc get_sparse_stiffness_matrices*(mesh2d: Mesh): (Tensor[float], Tensor[float], CsrMatrix) =
+  ## input: Mesh
+  ## output: (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat, stiffness_mat(CSR))
+
+  let (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat) = get_local_stiffness_matrices(mesh2d)
+
+  # Initial-5. Map local stiffness matrix with conductivity to global sparse stiffness matrix
+
+  let stiffness_mat = create_stiffness_mat_sparse(mesh2d, unitStackedLocalStiffnessMat).value
+
+  return (stackedLocalStiffnessMat, unitStackedLocalStiffnessMat, stiffness_mat)
@@ -0,0 +1,79 @@
+## 剛性行列用の疎行列(CSR形式)
+## 1. 各行の列インデックスは昇順に格納されていることを前提とする
+## 2. 剛性行列は対称だが、行列ベクトル積を単純にするため上下両方の三角成分を保持する
+
+import std/[algorithm]
+import arraymancer
+
+type
+  CsrMatrix* = object
+    ## 圧縮行格納(Compressed Sparse Row)形式の疎行列
+    ## 第r行の要素は colIdx[rowPtr[r]..<rowPtr[r+1]] と values[rowPtr[r]..<rowPtr[r+1]] に格納
+    numRows*: int
+    numCols*: int
+    rowPtr*: seq[int]
+    colIdx*: seq[int]
+    values*: seq[float]
+
+func nnz*(m: CsrMatrix): int =
+  ## 非零要素(として確保された要素)数
+  return len(m.colIdx)
+
+proc csr_from_pattern*(numRows: int, numCols: int, pattern: seq[seq[int]]): CsrMatrix =
+  ## 行毎の列インデックス集合から値0の疎行列を生成(列インデックスはここでソートされる)
+  var
+    rowPtr = newSeq[int](numRows+1)
+    colIdx: seq[int]
+
+  for r in 0..<numRows:
+    var cols = pattern[r]
+    cols.sort()
+    colIdx.add(cols)
+    rowPtr[r+1] = len(colIdx)
+
+  return CsrMatrix(numRows: numRows, numCols: numCols, rowPtr: rowPtr, colIdx: colIdx, values: newSeq[float](len(colIdx)))
+
+func find_entry*(m: CsrMatrix, r: int, c: int): int =
+  ## (r, c)要素の格納位置を二分探索で取得、パターン外であれば-1
+  var
+    lo = m.rowPtr[r]
+    hi = m.rowPtr[r+1] - 1
+  while lo <= hi:
+    let mid = (lo + hi) div 2
+    if m.colIdx[mid] == c:
+      return mid
+    elif m.colIdx[mid] < c:
+      lo = mid + 1
+    else:
+      hi = mid - 1
+  return -1
+
+func `[]`*(m: CsrMatrix, r: int, c: int): float =
+  let pos = m.find_entry(r, c)
+  if pos < 0:
+    return 0.0
+  return m.values[pos]
+
+func diagonal*(m: CsrMatrix): seq[float] =
+  result = newSeq[float](min(m.numRows, m.numCols))
+  for r in 0..<len(result):
+    result[r] = m[r, r]
+
+func `*`*(m: CsrMatrix, x: seq[float]): seq[float] =
+  ## 行列ベクトル積
+  result = newSeq[float](m.numRows)
+  for r in 0..<m.numRows:
+    var s = 0.0
+    for p in m.rowPtr[r]..<m.rowPtr[r+1]:
+      s += m.values[p]*x[m.colIdx[p]]
+    result[r] = s
+
+proc `*`*(m: CsrMatrix, x: Tensor[float]): Tensor[float] =
+  return (m * x.toSeq1D).toTensor
+
+proc to_dense*(m: CsrMatrix): Tensor[float] =
+  ## 密行列(arraymancerのTensor)に変換、主にデバッグや既存の密行列計算との比較用
+  result = zeros[float]([m.numRows, m.numCols])
+  for r in 0..<m.numRows:
+    for p in m.rowPtr[r]..<m.rowPtr[r+1]:
+      result[r, m.colIdx[p]] = m.values[p]
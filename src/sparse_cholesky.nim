@@ -0,0 +1,345 @@
+## 剛性行列(対称正定値な疎行列)用の疎コレスキー分解 K = P^T L L^T P
+## 1. 近似最小次数順序付け(AMD、消去グラフを商グラフで表し次数を上界で近似する)でフィルインを抑える
+## 2. シンボリック分解(消去木と L の列毎の非零数)は非零パターンのみに依存するため、σが変わっても再利用可能
+## 3. 数値分解は up-looking 法(https://github.com/DrTimothyAldenDavis/SuiteSparse/tree/dev/CSparse の cs_chol を参考)
+## 4. 一度分解すれば右辺を変えて何度でも solve できる
+
+import std/[heapqueue, algorithm, sequtils, math]
+import arraymancer, results
+import sparse
+
+type
+  CholeskySymbolic* = object
+    ## 非零パターンのみから決まる情報
+    n*: int
+    perm*: seq[int]
+      ## 新インデックス -> 元の頂点インデックス
+    pinv*: seq[int]
+      ## 元の頂点インデックス -> 新インデックス
+    parent*: seq[int]
+      ## 消去木の親(根は-1)
+    colPtr*: seq[int]
+      ## L(CSC形式)の列ポインタ
+
+  CholeskyFactor* = object
+    ## L を CSC 形式で保持、各列の先頭は対角成分
+    symbolic*: CholeskySymbolic
+    rowIdx*: seq[int]
+    values*: seq[float]
+
+proc minimum_degree_ordering*(a: CsrMatrix): seq[int] =
+  ## 近似最小次数順序付け(Amestoy, Davis, Duff 1996 のAMDの簡略版)、返り値は 新 -> 旧
+  ## 消去グラフ(フィルインのクリーク)を陽に作らず、未消去の頂点と「エレメント」(消去済みの頂点とその到達集合)からなる商グラフで表す
+  ## 1. ピボットpを消去すると、pに隣接するエレメントをpに吸収し、pの到達集合Lpを新しいエレメントpの頂点集合とする
+  ## 2. Lpの各頂点iの次数は厳密に数えず、min(残り頂点数 - 1, 旧次数 + |Lp| - 1, |iの隣接頂点| + |Lp| - 1 + Σ|Le \ Lp|) で近似する
+  ## 3. Le ⊆ Lp となったエレメントeもpに吸収する(aggressive absorption)
+  ## supervariable(隣接関係が同じ頂点の一括消去)は行わない
+  ## メモリは O(非零数 + Σ|Le|) で、クリークを辺として持つ厳密な次数の方法のようにフィルインの辺数に比例して増えない
+  ## 次数の更新は優先度付きキューへの再投入で行い、古いエントリは取り出し時に読み捨てる
+  let n = a.numRows
+  # varAdj: 隣接する未消去の頂点(エレメント経由で繋がる頂点は除く)
+  # elemAdj: 隣接するエレメント(吸収済みのものは読み捨てる)
+  # elemVars: エレメントの頂点集合 Le
+  # external: |Le \ Lp|(ピボット毎に数え、-1に戻す)
+  var
+    varAdj = newSeq[seq[int]](n)
+    elemAdj = newSeq[seq[int]](n)
+    elemVars = newSeq[seq[int]](n)
+    eliminated = newSeq[bool](n)
+    absorbed = newSeq[bool](n)
+    degree = newSeq[int](n)
+    mark = newSeqWith(n, -1)
+    external = newSeqWith(n, -1)
+    queue: HeapQueue[(int, int)]
+
+  for r in 0..<n:
+    for p in a.rowPtr[r]..<a.rowPtr[r+1]:
+      let c = a.colIdx[p]
+      if c != r:
+        varAdj[r].add(c)
+        varAdj[c].add(r)
+  for i in 0..<n:
+    varAdj[i].sort()
+    varAdj[i] = varAdj[i].deduplicate(isSorted = true)
+    degree[i] = len(varAdj[i])
+    queue.push((degree[i], i))
+
+  var numRemaining = n
+  while len(queue) > 0:
+    let (d, p) = queue.pop()
+    if eliminated[p] or d != degree[p]:
+      continue
+    eliminated[p] = true
+    numRemaining -= 1
+    result.add(p)
+
+    # 1. Lp = (pの隣接頂点 ∪ pに隣接するエレメントの頂点) \ {p}、隣接するエレメントはpに吸収する
+    # mark[i] == p であれば i ∈ Lp ∪ {p}
+    var lp: seq[int]
+    mark[p] = p
+    for i in varAdj[p]:
+      if not eliminated[i] and mark[i] != p:
+        mark[i] = p
+        lp.add(i)
+    for e in elemAdj[p]:
+      if absorbed[e]:
+        continue
+      for i in elemVars[e]:
+        if not eliminated[i] and mark[i] != p:
+          mark[i] = p
+          lp.add(i)
+      absorbed[e] = true
+      elemVars[e] = @[]
+    varAdj[p] = @[]
+    elemAdj[p] = @[]
+
+    # 2. Lpの頂点に隣接する他のエレメントについて |Le \ Lp| を数える
+    var touched: seq[int]
+    for i in lp:
+      for e in elemAdj[i]:
+        if absorbed[e]:
+          continue
+        if external[e] < 0:
+          external[e] = len(elemVars[e])
+          touched.add(e)
+        external[e] -= 1
+
+    # 3. 隣接関係を更新し、近似次数を求める
+    for i in lp:
+      var
+        elems: seq[int]
+        externalSum = 0
+      for e in elemAdj[i]:
+        if absorbed[e]:
+          continue
+        if external[e] == 0:
+          absorbed[e] = true
+          elemVars[e] = @[]
+          continue
+        externalSum += external[e]
+        elems.add(e)
+      elems.add(p)
+      elemAdj[i] = elems
+      # Lpの頂点同士はエレメントpを経由して繋がるため、頂点間の辺としては持たない
+      varAdj[i] = varAdj[i].filterIt(mark[it] != p and not eliminated[it])
+      degree[i] = min(numRemaining - 1, min(degree[i] + len(lp) - 1, len(varAdj[i]) + len(lp) - 1 + externalSum))
+      queue.push((degree[i], i))
+    for e in touched:
+      external[e] = -1
+    elemVars[p] = lp
+
+proc permuted_upper(a: CsrMatrix, pinv: seq[int]): (seq[int], seq[int], seq[float]) =
+  ## C = P A P^T の上三角部分を CSC 形式(列ポインタ, 行インデックス, 値)で取得
+  ## A は対称なので、A の CSR をそのまま C の列として読み替えられる
+  let n = a.numRows
+  var
+    counts = newSeq[int](n)
+    colPtr = newSeq[int](n+1)
+
+  for r in 0..<n:
+    for p in a.rowPtr[r]..<a.rowPtr[r+1]:
+      if pinv[r] <= pinv[a.colIdx[p]]:
+        counts[pinv[a.colIdx[p]]] += 1
+  for j in 0..<n:
+    colPtr[j+1] = colPtr[j] + counts[j]
+
+  var
+    next = colPtr[0..<n]
+    rowIdx = newSeq[int](colPtr[n])
+    values = newSeq[float](colPtr[n])
+  for r in 0..<n:
+    for p in a.rowPtr[r]..<a.rowPtr[r+1]:
+      let
+        i = pinv[r]
+        j = pinv[a.colIdx[p]]
+      if i <= j:
+        rowIdx[next[j]] = i
+        values[next[j]] = a.values[p]
+        next[j] += 1
+
+  return (colPtr, rowIdx, values)
+
+proc ereach(colPtr: seq[int], rowIdx: seq[int], k: int, parent: seq[int], stack: var seq[int], mark: var seq[int]): int =
+  ## L の第k行の非零パターン(消去木上で C の第k列の各行から k までを辿った経路)を stack[top..<n] に格納し top を返す
+  let n = len(parent)
+  var top = n
+  mark[k] = k
+  for p in colPtr[k]..<colPtr[k+1]:
+    var i = rowIdx[p]
+    if i > k:
+      continue
+    var length = 0
+    while mark[i] != k:
+      stack[length] = i
+      length += 1
+      mark[i] = k
+      i = parent[i]
+    while length > 0:
+      top -= 1
+      length -= 1
+      stack[top] = stack[length]
+  return top
+
+proc cholesky_symbolic*(a: CsrMatrix): Result[CholeskySymbolic, CatchableError] =
+  ## 順序付け、消去木、L の列毎の非零数を計算
+  if a.numRows != a.numCols:
+    return CatchableError(msg: "input must be square matrix!!").err()
+
+  let
+    n = a.numRows
+    perm = minimum_degree_ordering(a)
+  var pinv = newSeq[int](n)
+  for k in 0..<n:
+    pinv[perm[k]] = k
+
+  let (cColPtr, cRowIdx, _) = permuted_upper(a, pinv)
+
+  # 消去木(経路圧縮付き)
+  var
+    parent = newSeqWith(n, -1)
+    ancestor = newSeqWith(n, -1)
+  for k in 0..<n:
+    for p in cColPtr[k]..<cColPtr[k+1]:
+      var i = cRowIdx[p]
+      while i != -1 and i < k:
+        let inext = ancestor[i]
+        ancestor[i] = k
+        if inext == -1:
+          parent[i] = k
+        i = inext
+
+  # 列毎の非零数(対角成分 + 各行の非零パターンに現れる回数)
+  var
+    counts = newSeqWith(n, 1)
+    stack = newSeq[int](n)
+    mark = newSeqWith(n, -1)
+  for k in 0..<n:
+    let top = ereach(cColPtr, cRowIdx, k, parent, stack, mark)
+    for t in top..<n:
+      counts[stack[t]] += 1
+
+  var colPtr = newSeq[int](n+1)
+  for j in 0..<n:
+    colPtr[j+1] = colPtr[j] + counts[j]
+
+  return CholeskySymbolic(n: n, perm: perm, pinv: pinv, parent: parent, colPtr: colPtr).ok()
+
+proc cholesky_numeric*(a: CsrMatrix, symbolic: CholeskySymbolic): Result[CholeskyFactor, CatchableError] =
+  ## シンボリック分解を再利用して数値分解のみを行う(非零パターンが同じであればσのみ変えた剛性行列にも使える)
+  if a.numRows != symbolic.n or a.numCols != symbolic.n:
+    return CatchableError(msg: "matrix size does not match the symbolic factorization").err()
+
+  let
+    n = symbolic.n
+    colPtr = symbolic.colPtr
+    (cColPtr, cRowIdx, cValues) = permuted_upper(a, symbolic.pinv)
+  var
+    rowIdx = newSeq[int](colPtr[n])
+    values = newSeq[float](colPtr[n])
+    next = colPtr[0..<n]
+    x = newSeq[float](n)
+    stack = newSeq[int](n)
+    mark = newSeqWith(n, -1)
+
+  for k in 0..<n:
+    # L の第k行を三角求解で求める
+    let top = ereach(cColPtr, cRowIdx, k, symbolic.parent, stack, mark)
+    x[k] = 0.0
+    for p in cColPtr[k]..<cColPtr[k+1]:
+      if cRowIdx[p] <= k:
+        x[cRowIdx[p]] = cValues[p]
+    var d = x[k]
+    x[k] = 0.0
+    for t in top..<n:
+      let
+        i = stack[t]
+        lki = x[i]/values[colPtr[i]]
+      x[i] = 0.0
+      for p in colPtr[i]+1..<next[i]:
+        x[rowIdx[p]] -= values[p]*lki
+      d -= lki*lki
+      rowIdx[next[i]] = k
+      values[next[i]] = lki
+      next[i] += 1
+
+    if d <= 0.0:
+      return CatchableError(msg: "matrix is not positive definite").err()
+    rowIdx[next[k]] = k
+    values[next[k]] = sqrt(d)
+    next[k] += 1
+
+  return CholeskyFactor(symbolic: symbolic, rowIdx: rowIdx, values: values).ok()
+
+proc cholesky*(a: CsrMatrix): Result[CholeskyFactor, CatchableError] =
+  let symbolic = ?cholesky_symbolic(a)
+  return cholesky_numeric(a, symbolic)
+
+func nnz*(f: CholeskyFactor): int =
+  return len(f.values)
+
+proc solve*(f: CholeskyFactor, b: seq[float]): seq[float] =
+  ## K x = b を解く(前進代入 L y = P b、後退代入 L^T z = y、x = P^T z)
+  let
+    n = f.symbolic.n
+    perm = f.symbolic.perm
+    colPtr = f.symbolic.colPtr
+  var x = newSeq[float](n)
+  for k in 0..<n:
+    x[k] = b[perm[k]]
+
+  for j in 0..<n:
+    x[j] /= f.values[colPtr[j]]
+    for p in colPtr[j]+1..<colPtr[j+1]:
+      x[f.rowIdx[p]] -= f.values[p]*x[j]
+
+  for j in countdown(n-1, 0):
+    for p in colPtr[j]+1..<colPtr[j+1]:
+      x[j] -= f.values[p]*x[f.rowIdx[p]]
+    x[j] /= f.values[colPtr[j]]
+
+  result = newSeq[float](n)
+  for k in 0..<n:
+    result[perm[k]] = x[k]
+
+proc solve*(f: CholeskyFactor, b: Tensor[float]): Tensor[float] =
+  ## b: 長さnのベクトル、またはn*m行列(各列を別々の右辺として同時に解く)
+  ## 行列の場合は右辺を行優先に並べ直し、Lの各要素を一度読むだけで全ての列を更新する
+  if b.rank == 1:
+    return f.solve(b.toSeq1D).toTensor
+
+  let
+    n = f.symbolic.n
+    m = b.shape[1]
+    perm = f.symbolic.perm
+    colPtr = f.symbolic.colPtr
+  var x = newSeq[float](n*m)
+  for k in 0..<n:
+    for c in 0..<m:
+      x[k*m + c] = b[perm[k], c]
+
+  for j in 0..<n:
+    let d = f.values[colPtr[j]]
+    for c in 0..<m:
+      x[j*m + c] /= d
+    for p in colPtr[j]+1..<colPtr[j+1]:
+      let
+        i = f.rowIdx[p]
+        l = f.values[p]
+      for c in 0..<m:
+        x[i*m + c] -= l*x[j*m + c]
+
+  for j in countdown(n-1, 0):
+    for p in colPtr[j]+1..<colPtr[j+1]:
+      let
+        i = f.rowIdx[p]
+        l = f.values[p]
+      for c in 0..<m:
+        x[j*m + c] -= l*x[i*m + c]
+    let d = f.values[colPtr[j]]
+    for c in 0..<m:
+      x[j*m + c] /= d
+
+  result = newTensor[float](n, m)
+  for k in 0..<n:
+    for c in 0..<m:
+      result[perm[k], c] = x[k*m + c]
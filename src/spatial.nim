@@ -0,0 +1,157 @@
+## エレメントの空間索引(一様格子)
+## 1. 領域を約 エレメント数 個のセルに分割し、各セルに外接矩形(AABB)が重なるエレメントをCSR形式で登録
+## 2. 点を含むエレメント、矩形・円と重なるエレメントの検索は、該当するセルの候補のみを調べればよい
+##    (メッシュがほぼ一様であれば1セルあたりの候補数は定数程度)
+## 3. メッシュ(形状)毎に一度だけ構築し、位相設定・プローブ・描画で共有する
+
+import std/[math]
+import mesh, geometry
+
+type
+  ElementGrid* = object
+    minX*: float
+    minY*: float
+    cellSize*: float
+    numCellsX*: int
+    numCellsY*: int
+    cellPtr*: seq[int32]
+    cellElements*: seq[int32]
+      ## セル(cx, cy)のエレメントは cellElements[cellPtr[cy*numCellsX + cx]..<cellPtr[cy*numCellsX + cx + 1]]
+    bbMinX: seq[float]
+    bbMinY: seq[float]
+    bbMaxX: seq[float]
+    bbMaxY: seq[float]
+
+const pointInElementTolerance = 1e-12
+  ## 辺上の点を両側のエレメントで取りこぼさないための許容誤差(面積座標)
+
+func cell_x(grid: ElementGrid, x: float): int =
+  return clamp(int(floor((x - grid.minX)/grid.cellSize)), 0, grid.numCellsX - 1)
+
+func cell_y(grid: ElementGrid, y: float): int =
+  return clamp(int(floor((y - grid.minY)/grid.cellSize)), 0, grid.numCellsY - 1)
+
+proc build_element_grid*(geometry: MeshGeometry): ElementGrid =
+  let numElements = geometry.num_elements
+  var grid: ElementGrid
+  grid.bbMinX = newSeq[float](numElements)
+  grid.bbMinY = newSeq[float](numElements)
+  grid.bbMaxX = newSeq[float](numElements)
+  grid.bbMaxY = newSeq[float](numElements)
+
+  var
+    minX = Inf
+    minY = Inf
+    maxX = -Inf
+    maxY = -Inf
+  for e in 0..<numElements:
+    let
+      v1 = geometry.tri[3*e]
+      v2 = geometry.tri[3*e + 1]
+      v3 = geometry.tri[3*e + 2]
+    grid.bbMinX[e] = min(geometry.x[v1], min(geometry.x[v2], geometry.x[v3]))
+    grid.bbMinY[e] = min(geometry.y[v1], min(geometry.y[v2], geometry.y[v3]))
+    grid.bbMaxX[e] = max(geometry.x[v1], max(geometry.x[v2], geometry.x[v3]))
+    grid.bbMaxY[e] = max(geometry.y[v1], max(geometry.y[v2], geometry.y[v3]))
+    minX = min(minX, grid.bbMinX[e])
+    minY = min(minY, grid.bbMinY[e])
+    maxX = max(maxX, grid.bbMaxX[e])
+    maxY = max(maxY, grid.bbMaxY[e])
+
+  if numElements == 0:
+    (minX, minY, maxX, maxY) = (0.0, 0.0, 1.0, 1.0)
+
+  # 1. セルの大きさ: セル数がエレメント数程度になるように決める
+  let
+    width = max(maxX - minX, 1e-300)
+    height = max(maxY - minY, 1e-300)
+  grid.minX = minX
+  grid.minY = minY
+  grid.cellSize = max(sqrt(width*height/max(numElements, 1).float), 1e-300)
+  grid.numCellsX = max(1, int(ceil(width/grid.cellSize)))
+  grid.numCellsY = max(1, int(ceil(height/grid.cellSize)))
+
+  # 2. セル毎のエレメント数を数えてから詰める
+  let numCells = grid.numCellsX*grid.numCellsY
+  grid.cellPtr = newSeq[int32](numCells + 1)
+  for e in 0..<numElements:
+    for cy in grid.cell_y(grid.bbMinY[e])..grid.cell_y(grid.bbMaxY[e]):
+      for cx in grid.cell_x(grid.bbMinX[e])..grid.cell_x(grid.bbMaxX[e]):
+        grid.cellPtr[cy*grid.numCellsX + cx + 1] += 1
+  for c in 0..<numCells:
+    grid.cellPtr[c+1] += grid.cellPtr[c]
+
+  grid.cellElements = newSeq[int32](grid.cellPtr[numCells])
+  var fill = grid.cellPtr[0..^2]
+  for e in 0..<numElements:
+    for cy in grid.cell_y(grid.bbMinY[e])..grid.cell_y(grid.bbMaxY[e]):
+      for cx in grid.cell_x(grid.bbMinX[e])..grid.cell_x(grid.bbMaxX[e]):
+        let c = cy*grid.numCellsX + cx
+        grid.cellElements[fill[c]] = e.int32
+        fill[c] += 1
+
+  return grid
+
+proc build_element_grid*(mesh: Mesh): ElementGrid =
+  return build_element_grid(geometry_of(mesh))
+
+func barycentric*(geometry: MeshGeometry, e: int, x: float, y: float): (float, float, float) =
+  ## エレメントeに対する点(x, y)の面積座標(3頂点の重み)
+  let
+    v1 = geometry.tri[3*e]
+    v2 = geometry.tri[3*e + 1]
+    v3 = geometry.tri[3*e + 2]
+    det = (geometry.x[v2] - geometry.x[v1])*(geometry.y[v3] - geometry.y[v1]) - (geometry.y[v2] - geometry.y[v1])*(geometry.x[v3] - geometry.x[v1])
+    w2 = ((x - geometry.x[v1])*(geometry.y[v3] - geometry.y[v1]) - (y - geometry.y[v1])*(geometry.x[v3] - geometry.x[v1]))/det
+    w3 = ((geometry.x[v2] - geometry.x[v1])*(y - geometry.y[v1]) - (geometry.y[v2] - geometry.y[v1])*(x - geometry.x[v1]))/det
+  return (1.0 - w2 - w3, w2, w3)
+
+func locate_element*(grid: ElementGrid, geometry: MeshGeometry, x: float, y: float): int =
+  ## 点(x, y)を含むエレメント(領域外であれば-1)
+  if len(grid.cellPtr) == 0 or x < grid.minX or y < grid.minY or x > grid.minX + grid.numCellsX.float*grid.cellSize or y > grid.minY + grid.numCellsY.float*grid.cellSize:
+    return -1
+  let c = grid.cell_y(y)*grid.numCellsX + grid.cell_x(x)
+  for p in grid.cellPtr[c]..<grid.cellPtr[c+1]:
+    let e = grid.cellElements[p].int
+    if x < grid.bbMinX[e] or x > grid.bbMaxX[e] or y < grid.bbMinY[e] or y > grid.bbMaxY[e]:
+      continue
+    let (w1, w2, w3) = geometry.barycentric(e, x, y)
+    if w1 >= -pointInElementTolerance and w2 >= -pointInElementTolerance and w3 >= -pointInElementTolerance:
+      return e
+  return -1
+
+iterator elements_in_box*(grid: ElementGrid, xMin: float, yMin: float, xMax: float, yMax: float): int =
+  ## 外接矩形が矩形[xMin, xMax]*[yMin, yMax]と重なるエレメント(各エレメントは一度だけ返す)
+  ## 複数セルに登録されたエレメントは、検索範囲内で外接矩形の左下に当たるセルでのみ返すことで重複を除く
+  if len(grid.cellPtr) > 0 and xMax >= xMin and yMax >= yMin:
+    let
+      cx0 = grid.cell_x(xMin)
+      cy0 = grid.cell_y(yMin)
+    for cy in cy0..grid.cell_y(yMax):
+      for cx in cx0..grid.cell_x(xMax):
+        let c = cy*grid.numCellsX + cx
+        for p in grid.cellPtr[c]..<grid.cellPtr[c+1]:
+          let e = grid.cellElements[p].int
+          if grid.bbMaxX[e] < xMin or grid.bbMinX[e] > xMax or grid.bbMaxY[e] < yMin or grid.bbMinY[e] > yMax:
+            continue
+          if cx != max(grid.cell_x(grid.bbMinX[e]), cx0) or cy != max(grid.cell_y(grid.bbMinY[e]), cy0):
+            continue
+          yield e
+
+iterator elements_in_circle*(grid: ElementGrid, geometry: MeshGeometry, center: (float, float), R: float): int =
+  ## 重心が円内にあるエレメント
+  for e in grid.elements_in_box(center[0] - R, center[1] - R, center[0] + R, center[1] + R):
+    let
+      v1 = geometry.tri[3*e]
+      v2 = geometry.tri[3*e + 1]
+      v3 = geometry.tri[3*e + 2]
+      x0 = (geometry.x[v1] + geometry.x[v2] + geometry.x[v3])/3
+      y0 = (geometry.y[v1] + geometry.y[v2] + geometry.y[v3])/3
+    if (x0 - center[0])^2 + (y0 - center[1])^2 <= R^2:
+      yield e
+
+proc modify_σRef_circle_region*(grid: ElementGrid, geometry: MeshGeometry, frame: var Frame, centers: seq[(float, float)], Rs: seq[float], σRefs: seq[float]) =
+  ## geometry版の modify_σRef_circle_region と同じ結果を、円の外接矩形に掛かるセルのエレメントのみを調べて求める
+  for i in 0..<len(centers):
+    for e in grid.elements_in_circle(geometry, centers[i], Rs[i]):
+      frame.σRef[e] = σRefs[i]/geometry.area[e]
@@ -65,6 +65,25 @@ proc Js_from_toml*(path: string): Result[(seq[int], seq[float]), CatchableError]
   
   return (verts, Js).ok()
 
+proc current_patterns_from_toml*(path: string): Result[(string, float), CatchableError] =
+  ## 計測プロトコル(全電流注入パターン)の設定、[patterns]が無ければ空文字列を返す
+  let table = parseFile(path)
+  if not table.hasKey("patterns"):
+    return ("", 0.0).ok()
+  if not table["patterns"].hasKey("type"):
+    return CatchableError(msg: ".toml format is invalid, type is not found.").err()
+  if not table["patterns"].hasKey("amplitude"):
+    return CatchableError(msg: ".toml format is invalid, amplitude is not found.").err()
+  
+  return (table["patterns"]["type"].getStr, table["patterns"]["amplitude"].getFloat).ok()
+
+proc database_wal_from_toml*(path: string): Result[bool, CatchableError] =
+  ## mesh.tomlの[database]のwal(データベースをWALモードで使うか)、無ければfalse
+  let table = parseFile(path)
+  if not table.hasKey("database") or not table["database"].hasKey("wal"):
+    return false.ok()
+  return table["database"]["wal"].getBool.ok()
+
 proc experimentIDs_from_toml*(path: string): Result[(seq[int], seq[int]), CatchableError] =
   let table = parseFile(path)
   if not table["input"].hasKey("1stExperimentIDs"):
@@ -100,4 +119,32 @@ proc intentional_error_from_toml*(path: string): Result[(Table[string, Table[str
           "sigma": $table["error"]["Vs"]["Gaussian"]["sigma"].getFloat,
         }.toTable
     
-    return errors.ok()
\ No newline at end of file
+    return errors.ok()
+
+proc frames_from_toml*(path: string): Result[(int, int, int64), CatchableError] =
+  ## 入力.tomlの[frames]の(first, count, since): フレームストアから読むフレームの範囲、無ければ(0, 0, -1)
+  ## firstの代わりにsince(計測時刻、ns)を指定すると、その時刻以降の最初のフレームから読む(sinceが無ければ-1)
+  let table = parseFile(path)
+  if not table.hasKey("frames"):
+    return (0, 0, -1'i64).ok()
+  if not table["frames"].hasKey("first") and not table["frames"].hasKey("since"):
+    return CatchableError(msg: ".toml format is invalid, first or since is not found.").err()
+  if not table["frames"].hasKey("count"):
+    return CatchableError(msg: ".toml format is invalid, count is not found.").err()
+
+  let
+    first = if table["frames"].hasKey("first"): table["frames"]["first"].getInt else: 0
+    since = if table["frames"].hasKey("since"): table["frames"]["since"].getInt.int64 else: -1'i64
+  return (first, table["frames"]["count"].getInt, since).ok()
+
+proc series_from_toml*(path: string): Result[(int, (float, float)), CatchableError] =
+  ## 設定.tomlの[series]の(count, shift): 円領域を1フレーム毎にshiftだけ動かした時系列のフレーム数、無ければ(0, (0, 0))
+  let table = parseFile(path)
+  if not table.hasKey("series"):
+    return (0, (0.0, 0.0)).ok()
+  if not table["series"].hasKey("count"):
+    return CatchableError(msg: ".toml format is invalid, count is not found.").err()
+  if not table["series"].hasKey("shift"):
+    return CatchableError(msg: ".toml format is invalid, shift is not found.").err()
+
+  return (table["series"]["count"].getInt, (table["series"]["shift"][0].getFloat, table["series"]["shift"][1].getFloat)).ok()
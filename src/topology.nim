@@ -0,0 +1,111 @@
+## メッシュの隣接関係(トポロジー)
+## 1. エレメント間の隣接関係: neighbours[e][i] はエレメントeの第i頂点の対辺を共有するエレメント(外周であれば-1)
+## 2. 頂点 -> エレメントの逆引き(CSR形式): 頂点vを含むエレメントは vertElems[vertElemPtr[v]..<vertElemPtr[v+1]]
+## 3. 辺(重複なし)と外周辺
+## メッシュ生成後に一度だけ構築し、メッシュ生成・疎行列の組み立て・描画で共有する
+## 頂点・エレメント数は int32 の範囲に収まることを前提に、配列はint32で保持してメモリを節約する
+
+import std/[algorithm]
+import results
+import mesh
+
+type
+  MeshTopology* = object
+    numVertices*: int
+    numElements*: int
+    neighbours*: seq[array[3, int32]]
+    vertElemPtr*: seq[int32]
+    vertElems*: seq[int32]
+    edges*: seq[array[2, int32]]
+      ## 全ての辺(頂点インデックスは昇順)
+    boundaryEdges*: seq[array[2, int32]]
+      ## 外周辺(エレメント内での頂点の並び順のまま格納)
+
+func vertices_of(elem: Element): array[3, int] =
+  return [elem.idxVertice1, elem.idxVertice2, elem.idxVertice3]
+
+proc build_topology*(mesh: Mesh): Result[MeshTopology, CatchableError] =
+  ## 辺を(小さい頂点, 大きい頂点)でソートし、同じ辺を持つエレメント同士を隣接させる
+  ## ハッシュ表を使わずソートのみで構築する
+  let
+    numVertices = len(mesh.vertices)
+    numElements = len(mesh.elements)
+  if numVertices > int32.high or 3*numElements > int32.high:
+    return CatchableError(msg: "mesh is too large for int32 topology").err()
+
+  var topology = MeshTopology(numVertices: numVertices, numElements: numElements)
+  topology.neighbours = newSeq[array[3, int32]](numElements)
+  topology.vertElemPtr = newSeq[int32](numVertices + 1)
+
+  # 1. 頂点 -> エレメントの逆引き(計数してから詰める)
+  for elem in mesh.elements.items():
+    for v in elem.vertices_of:
+      if v < 0 or v >= numVertices:
+        return CatchableError(msg: "element refers to vertice " & $v & " which does not exist").err()
+      topology.vertElemPtr[v+1] += 1
+  for v in 0..<numVertices:
+    topology.vertElemPtr[v+1] += topology.vertElemPtr[v]
+
+  topology.vertElems = newSeq[int32](3*numElements)
+  var fill = topology.vertElemPtr[0..^2]
+  for (e, elem) in mesh.elements.pairs():
+    for v in elem.vertices_of:
+      topology.vertElems[fill[v]] = e.int32
+      fill[v] += 1
+
+  # 2. 辺を (小さい頂点, 大きい頂点, エレメント, 対頂点の位置) として列挙しソート
+  var halfEdges = newSeq[(int32, int32, int32, int32)](3*numElements)
+  for (e, elem) in mesh.elements.pairs():
+    let idxVerts = elem.vertices_of
+    topology.neighbours[e] = [-1'i32, -1, -1]
+    for i in 0..<3:
+      let
+        a = idxVerts[(i+1) mod 3].int32
+        b = idxVerts[(i+2) mod 3].int32
+      halfEdges[3*e + i] = (min(a, b), max(a, b), e.int32, i.int32)
+  halfEdges.sort()
+
+  # 3. 同じ辺が2つ続けば内部辺、1つのみであれば外周辺
+  var k = 0
+  while k < len(halfEdges):
+    let (a, b, e, i) = halfEdges[k]
+    topology.edges.add([a, b])
+    if k + 1 < len(halfEdges) and halfEdges[k+1][0] == a and halfEdges[k+1][1] == b:
+      let (_, _, f, j) = halfEdges[k+1]
+      if k + 2 < len(halfEdges) and halfEdges[k+2][0] == a and halfEdges[k+2][1] == b:
+        return CatchableError(msg: "edge (" & $a & ", " & $b & ") is shared by more than 2 elements").err()
+      topology.neighbours[e][i] = f
+      topology.neighbours[f][j] = e
+      k += 2
+    else:
+      let idxVerts = mesh.elements[e].vertices_of
+      topology.boundaryEdges.add([idxVerts[(i+1) mod 3].int32, idxVerts[(i+2) mod 3].int32])
+      k += 1
+
+  return topology.ok()
+
+iterator elements_of_vertice*(topology: MeshTopology, v: int): int =
+  ## 頂点vを含むエレメント
+  for p in topology.vertElemPtr[v]..<topology.vertElemPtr[v+1]:
+    yield topology.vertElems[p].int
+
+proc vertice_adjacency*(topology: MeshTopology): seq[seq[int]] =
+  ## 頂点毎の隣接頂点(自身を含む、昇順)
+  ## 剛性行列の非零パターンそのもの
+  result = newSeq[seq[int]](topology.numVertices)
+  for v in 0..<topology.numVertices:
+    result[v].add(v)
+  for edge in topology.edges.items():
+    result[edge[0]].add(edge[1].int)
+    result[edge[1]].add(edge[0].int)
+  for adjacency in result.mitems():
+    adjacency.sort()
+
+func is_boundary_vertice*(topology: MeshTopology, mesh: Mesh, v: int): bool =
+  ## 外周辺に接する頂点か(頂点を含むエレメントのいずれかが、vを含む辺で外周に接している)
+  for e in topology.elements_of_vertice(v):
+    let idxVerts = mesh.elements[e].vertices_of
+    for i in 0..<3:
+      if idxVerts[i] != v and topology.neighbours[e][i] == -1:
+        return true
+  return false
@@ -0,0 +1,33 @@
+## テストで共有する小さなメッシュと行列
+## generate_mesh と同じ手順(円周上の電極 + 同心円上の内部頂点をドロネー挿入)で、描画・保存を行わずに生成する
+
+import std/[math]
+import arraymancer, results
+import mesh, geometry, delaunay, forward, sparse
+
+proc small_mesh*(numElectrodes = 16, rings = @[(0.7, 12), (0.4, 6)]): Mesh =
+  ## 半径1の円、内部頂点は (半径, 個数) の同心円上に置く(電極と同じ角度を避けるため半周期ずらす)
+  result = generate_mesh_circle(numElectrodes, 1.0).value
+  var triangulation = init_delaunay(result).value
+  for (radius, count) in rings:
+    for i in 0..<count:
+      let θ = ((i.float + 0.5)/count.float)*2*PI
+      triangulation.insert_vertice(result, Vertice2D(pos: (radius*cos(θ), radius*sin(θ)))).value
+  triangulation.write_elements(result)
+  calculate_elements_area(result)
+
+  # 電極0から電極 numElectrodes div 2 へ電流を流す(電位基準点 numElectrodes div 4 とは重ならない)
+  result.vertices[0].J = 1.0
+  result.vertices[numElectrodes div 2].J = -1.0
+
+proc stiffness_of*(mesh: Mesh): (Tensor[float], CsrMatrix) =
+  ## (σRefでスケールした局所剛性行列, 剛性行列)
+  let scaled = scale_local_stiffness(stack_stiffness_mat_local_tri(mesh).value, frame_of(mesh).σRef).value
+  return (scaled, create_stiffness_mat_sparse(mesh, scaled).value)
+
+proc max_abs_diff*(a: Tensor[float], b: Tensor[float]): float =
+  return (a - b).abs.max
+
+proc max_abs_diff*(a: seq[float], b: seq[float]): float =
+  for i in 0..<len(a):
+    result = max(result, abs(a[i] - b[i]))
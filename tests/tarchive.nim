@@ -0,0 +1,122 @@
+## アーカイブの書き出し -> 取り込みで、実験・フレーム・メッシュのファイルがビット単位で元に戻ることを確かめる
+## 差分・バイト並べ替えは、隣の値より小さい値(差分が負)や非有限値、複数のフレームのチャンクでも可逆でなければならない
+
+import std/[unittest, os, math, tables]
+import arraymancer, results, db_connector/db_sqlite
+import mesh, cache, database, framestore, archive
+import fixtures
+
+proc same_bits(a: seq[float], b: seq[float]): bool =
+  if len(a) != len(b):
+    return false
+  for i in 0..<len(a):
+    if cast[uint64](a[i]) != cast[uint64](b[i]):
+      return false
+  return true
+
+suite "archive":
+  let
+    workDir = getTempDir() / "neit_test_archive"
+    originalDir = getCurrentDir()
+    mesh2d = small_mesh()
+    meshHash = mesh_hash(mesh2d)
+    numElements = len(mesh2d.elements)
+    numVertices = len(mesh2d.vertices)
+    numFrames = 300
+      # フレームのチャンク(256フレーム)を跨ぐ
+
+  setup:
+    removeDir(workDir)
+    createDir(workDir / "data" / "src")
+    setCurrentDir(workDir)
+
+  teardown:
+    setCurrentDir(originalDir)
+    removeDir(workDir)
+
+  test "export then import restores experiments, frames and files":
+    var records: seq[(int, ExperimentRecord)]
+    for id in [3, 7]:
+      var record = ExperimentRecord(σRef: newSeq[float](numElements), J: newSeq[float](numVertices), V: newSeq[float](numVertices),
+                                    patternID: id mod 2, timestamp: 1_700_000_000 + id.int64)
+      for e in 0..<numElements:
+        record.σRef[e] = 1.0 + sin(e.float + id.float)
+      for v in 0..<numVertices:
+        record.J[v] = if v == 0: 1.0 elif v == 8: -1.0 else: 0.0
+        record.V[v] = cos(v.float*id.float)
+      records.add((id, record))
+    records[1][1].V[2] = -0.0
+    records[1][1].V[3] = Inf
+    records[1][1].V[4] = NaN
+
+    let db = open("data/src/mesh.db", "", "", "")
+    check db.write_experiments(records, meshHash).isOk
+    db.close()
+    writeFile("data/src/mesh.toml", "[mesh]\nnumElectrodes = 16\n")
+
+    var h = init_content_hash()
+    h.add(mesh2d)
+    let layout = FrameLayout(meshHash: h.value, numElectrodes: mesh2d.numOuterVertices, numChannels: numVertices,
+                             numPatterns: 1, valueKind: fvFloat64)
+    var store = open_frame_store(frame_store_path("src"), layout, initialCapacity = 16).value
+    for k in 0..<numFrames:
+      var values = newSeq[float](numVertices)
+      for v in 0..<numVertices:
+        values[v] = sin(0.01*k.float + v.float) - 0.5
+      # 計測時刻は単調増加だが間隔は一定でない
+      check store.append_frame(1_000_000_000'i64*k.int64 + (k*k).int64, values).isOk
+    store.close()
+
+    let exported = export_archive(workDir / "out" / "src.neit", "src", mesh2d, @[3, 7], (0, numFrames))
+    check exported.isOk
+    check exported.value.numExperiments == 2
+    check exported.value.numFrames == numFrames
+
+    let imported = import_archive(workDir / "out" / "src.neit", "dst")
+    check imported.isOk
+    check imported.value.numExperiments == 2
+    check imported.value.numFrames == numFrames
+
+    # 1. 実験
+    let
+      dstDb = open("data/dst/mesh.db", "", "", "")
+      restored = dstDb.read_experiments(@[3, 7], numElements, numVertices, meshHash)
+    dstDb.close()
+    check restored.isOk
+    for (id, record) in records:
+      let r = restored.value[id]
+      check same_bits(r.σRef, record.σRef)
+      check same_bits(r.J, record.J)
+      check same_bits(r.V, record.V)
+      check r.patternID == record.patternID
+      check r.timestamp == record.timestamp
+
+    # 2. フレーム
+    var
+      src = open_frame_store(frame_store_path("src")).value
+      dst = open_frame_store(frame_store_path("dst")).value
+    check dst.layout == src.layout
+    check dst.num_frames == numFrames
+    check dst.frame_timestamps(0, numFrames).value == src.frame_timestamps(0, numFrames).value
+    check max_abs_diff(dst.read_frames(0, numFrames).value, src.read_frames(0, numFrames).value) == 0.0
+    src.close()
+    dst.close()
+
+    # 3. メッシュのファイル
+    check readFile("data/dst/mesh.toml") == readFile("data/src/mesh.toml")
+
+    # 同じ実験IDを二度取り込むことはできない
+    check import_archive(workDir / "out" / "src.neit", "dst").isErr
+
+  test "truncated archives are rejected without writing anything":
+    let db = open("data/src/mesh.db", "", "", "")
+    let record = ExperimentRecord(σRef: newSeq[float](numElements), J: newSeq[float](numVertices), V: newSeq[float](numVertices))
+    check db.write_experiments(@[(1, record)], meshHash).isOk
+    db.close()
+    check export_archive(workDir / "src.neit", "src", mesh2d, @[1], (0, 0)).isOk
+
+    let content = readFile(workDir / "src.neit")
+    writeFile(workDir / "broken.neit", content[0..<len(content) - 8])
+    check import_archive(workDir / "broken.neit", "dst").isErr
+    check not fileExists("data/dst/mesh.db")
+    check not fileExists(frame_store_path("dst"))
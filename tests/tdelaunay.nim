@@ -0,0 +1,89 @@
+## ドロネー挿入の結果(隣接関係・向き・空外接円)と、それから作るトポロジーを確かめる
+
+import std/[unittest, math]
+import results
+import mesh, delaunay, topology
+import fixtures
+
+func orientation(mesh: Mesh, tri: array[3, int]): float =
+  let
+    a = mesh.vertices[tri[0]].pos
+    b = mesh.vertices[tri[1]].pos
+    c = mesh.vertices[tri[2]].pos
+  return (b[0] - a[0])*(c[1] - a[1]) - (b[1] - a[1])*(c[0] - a[0])
+
+suite "delaunay insertion":
+  var
+    mesh2d = generate_mesh_circle(16, 1.0).value
+    dt = init_delaunay(mesh2d).value
+  for (radius, count) in [(0.7, 12), (0.4, 6), (0.15, 3)]:
+    for i in 0..<count:
+      let θ = ((i.float + 0.5)/count.float)*2*PI
+      dt.insert_vertice(mesh2d, Vertice2D(pos: (radius*cos(θ), radius*sin(θ)))).value
+
+  test "triangles are counter-clockwise and their neighbours are mutual":
+    for (t, tri) in dt.triangles.pairs():
+      if not dt.alive[t]:
+        continue
+      check orientation(mesh2d, tri) > 0
+      for i in 0..<3:
+        let u = dt.neighbours[t][i]
+        if u >= 0:
+          check dt.alive[u]
+          check t in dt.neighbours[u]
+          # 対辺(i+1, i+2)の2頂点を共有する
+          check tri[(i+1) mod 3] in dt.triangles[u]
+          check tri[(i+2) mod 3] in dt.triangles[u]
+
+  test "no vertex lies inside a circumcircle":
+    for (t, tri) in dt.triangles.pairs():
+      if not dt.alive[t]:
+        continue
+      let
+        a = mesh2d.vertices[tri[0]].pos
+        b = mesh2d.vertices[tri[1]].pos
+        c = mesh2d.vertices[tri[2]].pos
+        d = 2*(a[0]*(b[1] - c[1]) + b[0]*(c[1] - a[1]) + c[0]*(a[1] - b[1]))
+        ux = ((a[0]^2 + a[1]^2)*(b[1] - c[1]) + (b[0]^2 + b[1]^2)*(c[1] - a[1]) + (c[0]^2 + c[1]^2)*(a[1] - b[1]))/d
+        uy = ((a[0]^2 + a[1]^2)*(c[0] - b[0]) + (b[0]^2 + b[1]^2)*(a[0] - c[0]) + (c[0]^2 + c[1]^2)*(b[0] - a[0]))/d
+        r2 = (a[0] - ux)^2 + (a[1] - uy)^2
+      for (v, vert) in mesh2d.vertices.pairs():
+        if v notin tri:
+          check (vert.pos[0] - ux)^2 + (vert.pos[1] - uy)^2 >= r2*(1 - 1e-9)
+
+  test "triangles tile the electrode polygon":
+    var area = 0.0
+    for (t, tri) in dt.triangles.pairs():
+      if dt.alive[t]:
+        area += orientation(mesh2d, tri)/2
+    check abs(area - 16/2*sin(2*PI/16)) < 1e-12
+
+  test "vertices outside of the mesh are rejected":
+    check dt.insert_vertice(mesh2d, Vertice2D(pos: (2.0, 0.0))).isErr
+
+suite "topology":
+  let
+    mesh2d = small_mesh()
+    topology = build_topology(mesh2d).value
+
+  test "boundary is the electrode polygon":
+    check len(topology.boundaryEdges) == mesh2d.numOuterVertices
+    for v in 0..<len(mesh2d.vertices):
+      check topology.is_boundary_vertice(mesh2d, v) == (v < mesh2d.numOuterVertices)
+
+  test "element neighbours are mutual and vertice lists are complete":
+    for e in 0..<topology.numElements:
+      for i in 0..<3:
+        let f = topology.neighbours[e][i]
+        if f >= 0:
+          check e.int32 in topology.neighbours[f]
+    var count = 0
+    for v in 0..<topology.numVertices:
+      for e in topology.elements_of_vertice(v):
+        let elem = mesh2d.elements[e]
+        check v in [elem.idxVertice1, elem.idxVertice2, elem.idxVertice3]
+        count += 1
+    check count == 3*topology.numElements
+
+  test "euler characteristic of a disc":
+    check topology.numVertices - len(topology.edges) + topology.numElements == 1
@@ -0,0 +1,77 @@
+## フレームストアの追記・読み込み(追記中の読み込み側の refresh を含む)を確かめる
+
+import std/[unittest, os]
+import arraymancer, results
+import framestore
+
+proc remove_frame_store(path: string) =
+  discard tryRemoveFile(path)
+  discard tryRemoveFile(changeFileExt(path, "idx"))
+
+proc frame_values(k: int, numValues: int): seq[float] =
+  result = newSeq[float](numValues)
+  for i in 0..<numValues:
+    result[i] = k.float + i.float/10
+
+suite "frame store":
+  let
+    path = getTempDir() / "neit_test_frames.bin"
+    layout = FrameLayout(meshHash: 42, numElectrodes: 4, numChannels: 3, numPatterns: 2, valueKind: fvFloat64)
+    numValues = layout.num_values
+
+  setup:
+    remove_frame_store(path)
+
+  teardown:
+    remove_frame_store(path)
+
+  test "appended frames are read back, also by a reader opened before the store grows":
+    var writer = open_frame_store(path, layout, initialCapacity = 2).value
+    check writer.append_frame(100, frame_values(0, numValues)).isOk
+    var reader = open_frame_store(path).value
+    for k in 1..<5:
+      check writer.append_frame(100 + 10*k.int64, frame_values(k, numValues)).isOk
+    check writer.num_frames == 5
+
+    # 読み込み側は開いた時点の大きさまでしかmmapしていない
+    check reader.num_frames <= 5
+    check reader.refresh().isOk
+    check reader.num_frames == 5
+    let frames = reader.read_frames(0, 5).value
+    check frames.shape == [5, numValues]
+    for k in 0..<5:
+      for i in 0..<numValues:
+        check frames[k, i] == frame_values(k, numValues)[i]
+    check reader.frame_timestamps(1, 3).value == @[110'i64, 120, 130]
+    check reader.read_frames(3, 3).isErr
+
+    # 計測時刻がtimestamp以上の最初のフレーム
+    check reader.find_frame(0) == 0
+    check reader.find_frame(120) == 2
+    check reader.find_frame(121) == 3
+    check reader.find_frame(1000) == 5
+    reader.close()
+    writer.close()
+
+  test "a reopened store keeps its frames and rejects another layout":
+    var writer = open_frame_store(path, layout).value
+    check writer.append_frame(1, frame_values(7, numValues)).isOk
+    writer.close()
+
+    var other = layout
+    other.numPatterns = 3
+    check open_frame_store(path, other).isErr
+
+    var reopened = open_frame_store(path, layout).value
+    check reopened.num_frames == 1
+    check reopened.read_frames(0, 1).value[0, 1] == frame_values(7, numValues)[1]
+    reopened.close()
+
+  test "invalid appends are rejected":
+    var writer = open_frame_store(path, layout).value
+    check writer.append_frame(1, newSeq[float](numValues - 1)).isErr
+    check writer.append_frame(1, frame_values(0, numValues)).isOk
+    writer.close()
+    var reader = open_frame_store(path).value
+    check reader.append_frame(2, frame_values(0, numValues)).isErr
+    reader.close()
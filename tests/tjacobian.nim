@@ -0,0 +1,59 @@
+## 随伴場のヤコビアンを、単一パターンのヤコビアン(compute_jac_2d_tri)および有限差分と比較する
+
+import std/[unittest]
+import arraymancer, results
+import mesh, geometry, forward, backward, sparse_cholesky
+import fixtures
+
+suite "adjoint jacobian":
+  let
+    mesh2d = small_mesh()
+    geometry = geometry_of(mesh2d)
+    stacked = stack_stiffness_mat_local_tri(geometry).value
+    (scaled, K) = stiffness_of(mesh2d)
+    factor = cholesky(K).value
+    n = geometry.num_vertices
+    numElectrodes = geometry.numOuterVertices
+    idxReference = geometry.idx_reference_vertice
+
+  test "single pattern with electrode measurements matches compute_jac_2d_tri":
+    var frame = frame_of(mesh2d)
+    frame.V = factor.solve(frame.J)
+    var electrodes = zeros[float]([n, numElectrodes])
+    for k in 0..<numElectrodes:
+      electrodes[k, k] = 1.0
+    let
+      direct = compute_jac_2d_tri(geometry, frame, factor, scaled).value
+      adjoint = compute_jac_adjoint_2d_tri(geometry, factor, scaled, frame.J.toTensor.reshape(n, 1), electrodes).value
+    check adjoint.shape == [numElectrodes, geometry.num_elements]
+    # 電位基準点の電位は固定されているため、その行は随伴場では0になる
+    for m in 0..<numElectrodes:
+      if m == idxReference:
+        check adjoint[m, _].abs.max == 0.0
+      else:
+        check max_abs_diff(adjoint[m, _], direct[m, _]) < 1e-10
+
+  test "adjacent patterns match central finite differences":
+    let
+      drive = adjacent_current_patterns(mesh2d, 1.0)
+      meas = adjacent_measurement_patterns(mesh2d)
+      adjoint = compute_jac_adjoint_2d_tri(geometry, factor, scaled, drive, meas).value
+      h = 1e-6
+      scale = adjoint.abs.max
+    check adjoint.shape == [numElectrodes*numElectrodes, geometry.num_elements]
+
+    for e in [0, geometry.num_elements div 2, geometry.num_elements - 1]:
+      var σPlus = frame_of(mesh2d).σRef
+      var σMinus = σPlus
+      σPlus[e] += h
+      σMinus[e] -= h
+      let
+        uPlus = cholesky(create_stiffness_mat_sparse(mesh2d, scale_local_stiffness(stacked, σPlus).value).value).value.solve(drive)
+        uMinus = cholesky(create_stiffness_mat_sparse(mesh2d, scale_local_stiffness(stacked, σMinus).value).value).value.solve(drive)
+        # 計測数*注入数、行の順(d*計測数 + m)に並べ替える
+        difference = ((meas.transpose*(uPlus - uMinus))/(2*h)).transpose.clone().reshape(numElectrodes*numElectrodes)
+      check max_abs_diff(difference, adjoint[_, e].squeeze(1).clone()) < 1e-5*scale
+
+  test "shapes are validated":
+    check compute_jac_adjoint_2d_tri(geometry, factor, scaled, zeros[float]([n - 1, 1]), zeros[float]([n, 1])).isErr
+    check compute_jac_adjoint_2d_tri(geometry, factor, stacked[0..<1, _, _], zeros[float]([n, 1]), zeros[float]([n, 1])).isErr
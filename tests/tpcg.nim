@@ -0,0 +1,40 @@
+## 前処理付き共役勾配法を疎コレスキー分解の解と比較する
+
+import std/[unittest]
+import results
+import mesh, forward, sparse_cholesky
+import fixtures
+
+suite "pcg":
+  var mesh2d = small_mesh()
+  let
+    (_, K) = stiffness_of(mesh2d)
+    n = K.numRows
+  var J = newSeq[float](n)
+  for (i, vert) in mesh2d.vertices.pairs():
+    J[i] = vert.J
+  let expected = cholesky(K).value.solve(J)
+
+  test "jacobi and incomplete cholesky converge to the direct solution":
+    for kind in [Jacobi, IncompleteCholesky]:
+      let solved = pcg(K, J, newSeq[float](n), create_preconditioner(K, kind).value, tol = 1e-12)
+      check solved.isOk
+      check solved.value.converged
+      check max_abs_diff(solved.value.V, expected) < 1e-8
+
+  test "warm start from the solution needs no iteration":
+    let solved = pcg(K, J, expected, create_preconditioner(K, Jacobi).value, tol = 1e-8).value
+    check solved.iterations == 0
+    check solved.converged
+
+  test "forward_pcg updates the mesh potentials":
+    let solved = forward_pcg(mesh2d, K, create_preconditioner(K, IncompleteCholesky).value, tol = 1e-12)
+    check solved.isOk
+    for (i, vert) in mesh2d.vertices.pairs():
+      check abs(vert.V - expected[i]) < 1e-8
+
+  test "mismatched lengths are rejected":
+    let pre = create_preconditioner(K, Jacobi).value
+    check pcg(K, J[0..^2], newSeq[float](n), pre).isErr
+    check pcg(K, J, newSeq[float](n + 1), pre).isErr
+    check pcg(K, J, newSeq[float](n), Preconditioner(kind: Jacobi, invDiag: newSeq[float](n - 1))).isErr
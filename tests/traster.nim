@@ -0,0 +1,64 @@
+## ラスタマップ(固定小数点の辺関数による走査)のトップレフトルールと面積座標を確かめる
+
+import std/[unittest]
+import arraymancer, results
+import geometry, raster
+
+suite "raster map":
+  # 正方形を中心で4つの三角形に分割、対角線はピクセルのサンプル点((-4 + i, -4 + j))をちょうど通る
+  let
+    geometry = MeshGeometry(numOuterVertices: 4,
+      x: @[-4.0, 4.0, 4.0, -4.0, 0.0], y: @[-4.0, -4.0, 4.0, 4.0, 0.0],
+      tri: @[0'i32, 1, 4, 1, 2, 4, 2, 3, 4, 3, 0, 4], area: @[16.0, 16.0, 16.0, 16.0])
+    resolution = (8, 8)
+    drawingArea = ((-4.0, -4.0), (4.0, 4.0))
+
+  test "pixels on shared edges belong to exactly one element":
+    var coverage = newSeq[int](resolution[0]*resolution[1])
+    for e in 0..<geometry.num_elements:
+      # エレメントを1つずつ走査し、各ピクセルを塗ったエレメントの数を数える
+      let single = MeshGeometry(numOuterVertices: 4, x: geometry.x, y: geometry.y,
+        tri: geometry.tri[3*e..<3*e + 3], area: @[geometry.area[e]])
+      let map = build_raster_map(single, resolution, drawingArea)
+      for pixel in 0..<len(coverage):
+        if map.element[pixel] >= 0:
+          coverage[pixel] += 1
+    # 正方形の内部(外周上でない)サンプル点は、対角線上・中心も含めてちょうど1回
+    for i in 1..<resolution[0]:
+      for j in 1..<resolution[1]:
+        check coverage[i*resolution[1] + j] == 1
+
+  test "reversed triangles are rasterized the same way":
+    var reversed = geometry
+    for e in 0..<reversed.num_elements:
+      swap(reversed.tri[3*e + 1], reversed.tri[3*e + 2])
+    let
+      map = build_raster_map(geometry, resolution, drawingArea)
+      reversedMap = build_raster_map(reversed, resolution, drawingArea)
+    check map.element == reversedMap.element
+
+  test "barycentric weights interpolate linear functions exactly":
+    let
+      map = build_raster_map(geometry, resolution, drawingArea)
+      values = @[-4.0 - 8.0, 4.0 - 8.0, 4.0 + 8.0, -4.0 + 8.0, 0.0]
+      image = map.gather_vertice_values(geometry, values)
+    for i in 0..<resolution[0]:
+      for j in 0..<resolution[1]:
+        let pixel = i*resolution[1] + j
+        if map.element[pixel] >= 0 and not map.masked[pixel]:
+          let w = map.weights[pixel]
+          check abs(w[0] + w[1] + w[2] - 1.0) < 1e-6
+          check abs(image[pixel] - (map.pixel_x(i) + 2*map.pixel_y(j))) < 1e-5
+
+  test "batch gather matches single-frame gather":
+    let
+      map = build_raster_map(geometry, resolution, drawingArea)
+      values = [[1.0, 2.0, 3.0, 4.0], [-1.0, 0.5, 0.0, 8.0]].toTensor
+    var images = newTensor[float32](2, resolution[0]*resolution[1])
+    check map.gather_element_values_batch(values, images).isOk
+    for f in 0..<2:
+      let single = map.gather_element_values(@[values[f, 0], values[f, 1], values[f, 2], values[f, 3]])
+      for pixel in 0..<len(single):
+        check images[f, pixel].float == single[pixel]
+    var wrongShape = newTensor[float32](1, resolution[0]*resolution[1])
+    check map.gather_element_values_batch(values, wrongShape).isErr
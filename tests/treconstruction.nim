@@ -0,0 +1,30 @@
+## 計測空間(Woodburyの恒等式)の再構成行列を、パラメータ空間の再構成行列と比較する
+
+import std/[unittest]
+import arraymancer, results
+import backward
+import fixtures
+
+suite "reconstruction matrix":
+  test "data space equals parameter space":
+    # 計測数 < エレメント数(計測空間が選ばれる側)
+    let jac = randomTensor[float](12, 40, 1.0)
+    for (α, p) in [(1.0, 1.0), (0.1, 0.5)]:
+      let
+        parameterSpace = jac.δσ_over_δV(α, p, ParameterSpace).value
+        dataSpace = jac.δσ_over_δV(α, p, DataSpace).value
+      check dataSpace.shape == [40, 12]
+      check max_abs_diff(dataSpace, parameterSpace) < 1e-8*parameterSpace.abs.max
+
+  test "insensitive elements get zero rows in both spaces":
+    var jac = randomTensor[float](8, 20, 1.0)
+    jac[_, 3] = zeros[float]([8, 1])
+    let
+      parameterSpace = jac.δσ_over_δV(1.0, 1.0, ParameterSpace).value
+      dataSpace = jac.δσ_over_δV(1.0, 1.0, DataSpace).value
+    check dataSpace[3, _].abs.max == 0.0
+    check max_abs_diff(dataSpace, parameterSpace) < 1e-8*parameterSpace.abs.max
+
+  test "auto picks the smaller space":
+    let jac = randomTensor[float](10, 30, 1.0)
+    check max_abs_diff(jac.δσ_over_δV(1.0, 1.0).value, jac.δσ_over_δV(1.0, 1.0, DataSpace).value) == 0.0
@@ -0,0 +1,45 @@
+## 疎コレスキー分解と近似最小次数順序付けを、密行列の逆行列による解と比較する
+
+import std/[unittest, algorithm, sequtils, random]
+import arraymancer, results
+import sparse, sparse_cholesky
+import fixtures
+
+suite "sparse cholesky":
+  let
+    mesh2d = small_mesh()
+    (_, K) = stiffness_of(mesh2d)
+    n = K.numRows
+
+  test "ordering is a permutation of the vertices":
+    let perm = minimum_degree_ordering(K)
+    check len(perm) == n
+    check perm.sorted == toSeq(0..<n)
+
+  test "factor is sparser than a dense factor":
+    # Lの非零数は Kの下三角の非零数 以上、密な下三角 未満
+    let factor = cholesky(K).value
+    check factor.nnz >= (K.nnz + n) div 2
+    check factor.nnz < n*(n + 1) div 2
+
+  test "solve matches the dense solve":
+    var rng = initRand(1)
+    let
+      b = newSeqWith(n, rng.rand(-1.0..1.0))
+      x = cholesky(K).value.solve(b)
+      expected = K.to_dense.pinv*b.toTensor
+    check max_abs_diff(x.toTensor, expected) < 1e-9
+    check max_abs_diff(K*x, b) < 1e-9
+
+  test "multi-column solve matches column by column":
+    let
+      factor = cholesky(K).value
+      B = randomTensor[float](n, 3, 1.0)
+      X = factor.solve(B)
+    for j in 0..<3:
+      let column = factor.solve(B[_, j].squeeze(1).clone().toSeq1D)
+      check max_abs_diff(X[_, j].squeeze(1).clone(), column.toTensor) < 1e-12
+
+  test "non-square matrix is rejected":
+    let rectangular = csr_from_pattern(2, 3, @[@[0], @[1]])
+    check cholesky(rectangular).isErr